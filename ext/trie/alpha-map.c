@@ -0,0 +1,197 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * alpha-map.c - map between character codes and trie alphabet
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "trie-private.h"
+#include "alpha-map.h"
+#include "fileutils.h"
+
+/*------------------------------*
+ *    PRIVATE DATA DEFINITONS   *
+ *------------------------------*/
+
+/* 'to_trie' is 0 for characters outside the alphabet, and 'to_alpha' is 0
+ * for codes not in use; both keep TRIE_CHAR_TERM at 0.
+ */
+struct _AlphaMap {
+    TrieChar    to_trie[TRIE_CHAR_MAX + 1];
+    TrieChar    to_alpha[TRIE_CHAR_MAX + 1];
+    int         num_chars;
+};
+
+/*-----------------------------------*
+ *    PRIVATE METHODS DECLARATIONS   *
+ *-----------------------------------*/
+
+static void     alpha_map_renumber (AlphaMap *alpha_map);
+
+/*-----------------------------*
+ *    METHODS IMPLEMENTAIONS   *
+ *-----------------------------*/
+
+#define ALPHAMAP_SIGNATURE  0xD9FCD9FC
+
+/* AlphaMap Header:
+ * - INT32: signature
+ * - INT32: total ranges
+ *
+ * Ranges:
+ * - INT32: range begin
+ * - INT32: range end
+ */
+
+AlphaMap *
+alpha_map_new ()
+{
+    AlphaMap   *alpha_map;
+
+    alpha_map = (AlphaMap *) calloc (1, sizeof (AlphaMap));
+
+    return alpha_map;
+}
+
+AlphaMap *
+alpha_map_read (FILE *file)
+{
+    long        save_pos;
+    uint32      sig;
+    int32       total, i;
+    AlphaMap   *alpha_map;
+
+    /* check signature */
+    save_pos = ftell (file);
+    if (!file_read_int32 (file, (int32 *) &sig) || ALPHAMAP_SIGNATURE != sig) {
+        fseek (file, save_pos, SEEK_SET);
+        return NULL;
+    }
+
+    alpha_map = alpha_map_new ();
+    if (!alpha_map)
+        return NULL;
+
+    /* read number of ranges */
+    if (!file_read_int32 (file, &total))
+        goto exit_map_created;
+
+    /* read character ranges */
+    for (i = 0; i < total; i++) {
+        int32   b, e;
+
+        if (!file_read_int32 (file, &b) || !file_read_int32 (file, &e))
+            goto exit_map_created;
+        if (alpha_map_add_range (alpha_map, b, e) != 0)
+            goto exit_map_created;
+    }
+
+    return alpha_map;
+
+exit_map_created:
+    alpha_map_free (alpha_map);
+    return NULL;
+}
+
+void
+alpha_map_free (AlphaMap *alpha_map)
+{
+    free (alpha_map);
+}
+
+int
+alpha_map_write (const AlphaMap *alpha_map, FILE *file)
+{
+    int32       total;
+    int         c, e;
+
+    /* a range starts at each member following a non-member */
+    total = 0;
+    for (c = 1; c <= TRIE_CHAR_MAX; c++) {
+        if (alpha_map->to_trie[c] && !alpha_map->to_trie[c - 1])
+            ++total;
+    }
+
+    if (!file_write_int32 (file, ALPHAMAP_SIGNATURE) ||
+        !file_write_int32 (file, total))
+    {
+        return -1;
+    }
+
+    for (c = 1; c <= TRIE_CHAR_MAX; c = e + 1) {
+        if (!alpha_map->to_trie[c]) {
+            e = c;
+            continue;
+        }
+        for (e = c; e < TRIE_CHAR_MAX && alpha_map->to_trie[e + 1]; e++)
+            ;
+        if (!file_write_int32 (file, c) || !file_write_int32 (file, e))
+            return -1;
+    }
+
+    return 0;
+}
+
+int
+alpha_map_add_range (AlphaMap *alpha_map, AlphaChar begin, AlphaChar end)
+{
+    AlphaChar   c;
+
+    if (begin < 1 || begin > end || end > TRIE_CHAR_MAX)
+        return -1;
+
+    for (c = begin; c <= end; c++)
+        alpha_map->to_trie[c] = 1;
+    alpha_map_renumber (alpha_map);
+
+    return 0;
+}
+
+int
+alpha_map_num_chars (const AlphaMap *alpha_map)
+{
+    return alpha_map->num_chars;
+}
+
+int
+alpha_map_char_to_trie (const AlphaMap *alpha_map, AlphaChar ac)
+{
+    if (TRIE_CHAR_TERM == ac)
+        return TRIE_CHAR_TERM;
+    if (ac > TRIE_CHAR_MAX || !alpha_map->to_trie[ac])
+        return -1;
+    return alpha_map->to_trie[ac];
+}
+
+AlphaChar
+alpha_map_trie_to_char (const AlphaMap *alpha_map, TrieChar tc)
+{
+    if (TRIE_CHAR_TERM == tc)
+        return TRIE_CHAR_TERM;
+    if (!alpha_map->to_alpha[tc])
+        return ALPHA_CHAR_ERROR;
+    return alpha_map->to_alpha[tc];
+}
+
+/* give members codes from 1 up in character order */
+static void
+alpha_map_renumber (AlphaMap *alpha_map)
+{
+    int     c, code;
+
+    memset (alpha_map->to_alpha, 0, sizeof (alpha_map->to_alpha));
+    code = 0;
+    for (c = 1; c <= TRIE_CHAR_MAX; c++) {
+        if (alpha_map->to_trie[c]) {
+            alpha_map->to_trie[c] = ++code;
+            alpha_map->to_alpha[code] = c;
+        }
+    }
+    alpha_map->num_chars = code;
+}
+
+/*
+vi:ts=4:ai:expandtab
+*/
@@ -0,0 +1,129 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * alpha-map.h - map between character codes and trie alphabet
+ */
+
+#ifndef __ALPHA_MAP_H
+#define __ALPHA_MAP_H
+
+#include <stdio.h>
+
+#include "triedefs.h"
+
+/**
+ * @file alpha-map.h
+ * @brief AlphaMap data type and functions
+ *
+ * AlphaMap is a mapping between the characters of the keys and the
+ * internal alphabet of the trie. The alphabet is a set of byte ranges,
+ * and its members are given dense codes from 1 upward in byte order, so
+ * that a small alphabet takes a narrow label range in the double array
+ * while keys still enumerate in byte order. Code 0 stays reserved for
+ * TRIE_CHAR_TERM, so the NUL byte cannot be a member.
+ */
+
+/**
+ * @brief AlphaMap data type
+ */
+typedef struct _AlphaMap    AlphaMap;
+
+/**
+ * @brief Create new alphabet map
+ *
+ * @return a pointer to the newly created alphabet map, NULL on failure
+ *
+ * Create a new empty alphabet map. The map contents can then be added with
+ * alpha_map_add_range().
+ */
+AlphaMap *  alpha_map_new ();
+
+/**
+ * @brief Read alphabet map data from file
+ *
+ * @param file : the file to read
+ *
+ * @return a pointer to the read alphabet map, NULL on failure
+ *
+ * Read alphabet map data from the opened file, starting from the current
+ * file pointer. If the data there is not an alphabet map, NULL is returned
+ * and the file pointer is left unchanged. Otherwise, on return, the file
+ * pointer is left at the position after the read block.
+ */
+AlphaMap *  alpha_map_read (FILE *file);
+
+/**
+ * @brief Free an alphabet map object
+ *
+ * @param alpha_map : the alphabet map object to free
+ *
+ * Destruct the given alphabet map and free its allocated memory.
+ */
+void        alpha_map_free (AlphaMap *alpha_map);
+
+/**
+ * @brief Write alphabet map data to file
+ *
+ * @param alpha_map : the alphabet map to write
+ * @param file      : the file to write to
+ *
+ * @return 0 on success, non-zero on failure
+ *
+ * Write the alphabet map as a list of ranges to the given @a file,
+ * starting from the current file pointer. On return, the file pointer is
+ * left after the alphabet map data block.
+ */
+int         alpha_map_write (const AlphaMap *alpha_map, FILE *file);
+
+/**
+ * @brief Add a range to alphabet map
+ *
+ * @param alpha_map : the alphabet map object
+ * @param begin     : the first character of the range
+ * @param end       : the last character of the range
+ *
+ * @return 0 on success, non-zero on failure
+ *
+ * Add a range of characters to the alphabet map, renumbering the codes of
+ * the whole alphabet. The range must lie within 1..TRIE_CHAR_MAX.
+ */
+int         alpha_map_add_range (AlphaMap  *alpha_map,
+                                 AlphaChar  begin,
+                                 AlphaChar  end);
+
+/**
+ * @brief Get the number of characters in alphabet map
+ *
+ * @param alpha_map : the alphabet map object
+ *
+ * @return the number of characters in the alphabet
+ */
+int         alpha_map_num_chars (const AlphaMap *alpha_map);
+
+/**
+ * @brief Map a character to its trie code
+ *
+ * @param alpha_map : the alphabet map object
+ * @param ac        : the character to map
+ *
+ * @return the code of @a ac, or -1 if it is not in the alphabet
+ *
+ * TRIE_CHAR_TERM always maps to itself.
+ */
+int         alpha_map_char_to_trie (const AlphaMap *alpha_map, AlphaChar ac);
+
+/**
+ * @brief Map a trie code back to its character
+ *
+ * @param alpha_map : the alphabet map object
+ * @param tc        : the code to map
+ *
+ * @return the character coded as @a tc, or ALPHA_CHAR_ERROR if @a tc is
+ *         not in use
+ */
+AlphaChar   alpha_map_trie_to_char (const AlphaMap *alpha_map, TrieChar tc);
+
+#endif  /* __ALPHA_MAP_H */
+
+/*
+vi:ts=4:ai:expandtab
+*/
@@ -8,6 +8,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 
 #include "trie-private.h"
 #include "darray.h"
@@ -36,14 +37,27 @@ static void         symbols_add (Symbols *syms, TrieChar c);
  *    PRIVATE METHODS DECLARATIONS   *
  *-----------------------------------*/
 
-#define da_get_free_list(d)      (1)
-
 static Bool         da_check_free_cell (DArray         *d,
                                         TrieIndex       s);
 
-static Bool         da_has_children    (DArray         *d,
+static Bool         da_has_children    (const DArray   *d,
+                                        TrieIndex       s);
+
+static int          da_num_children    (const DArray   *d,
+                                        TrieIndex       s);
+
+static Bool         da_is_ancestor     (const DArray   *d,
+                                        TrieIndex       a,
                                         TrieIndex       s);
 
+static void         da_link_child      (DArray         *d,
+                                        TrieIndex       s,
+                                        TrieChar        c);
+
+static void         da_unlink_child    (DArray         *d,
+                                        TrieIndex       s,
+                                        TrieChar        c);
+
 static Symbols *    da_output_symbols  (const DArray   *d,
                                         TrieIndex       s);
 
@@ -53,7 +67,11 @@ static TrieChar *   da_get_state_key   (const DArray   *d,
 static TrieIndex    da_find_free_base  (DArray         *d,
                                         const Symbols  *symbols);
 
-static Bool         da_fit_symbols     (DArray         *d,
+static TrieIndex    da_place_symbols   (DArray         *d,
+                                        TrieIndex       s,
+                                        const Symbols  *symbols);
+
+static uint64_t     da_fit_symbols     (const DArray   *d,
                                         TrieIndex       base,
                                         const Symbols  *symbols);
 
@@ -64,12 +82,27 @@ static void         da_relocate_base   (DArray         *d,
 static Bool         da_extend_pool     (DArray         *d,
                                         TrieIndex       to_index);
 
+static Bool         da_set_alloc       (DArray         *d,
+                                        TrieIndex       alloc_cells);
+
 static void         da_alloc_cell      (DArray         *d,
                                         TrieIndex       cell);
 
 static void         da_free_cell       (DArray         *d,
                                         TrieIndex       cell);
 
+static TrieIndex    da_fit_block       (const DArray   *d,
+                                        TrieIndex       block,
+                                        const Symbols  *symbols);
+
+static void         da_push_block      (DArray         *d,
+                                        TrieIndex      *list,
+                                        TrieIndex       block);
+
+static void         da_pop_block       (DArray         *d,
+                                        TrieIndex      *list,
+                                        TrieIndex       block);
+
 static Bool         da_enumerate_recursive (const DArray   *d,
                                             TrieIndex       state,
                                             DAEnumFunc      enum_func,
@@ -132,15 +165,38 @@ symbols_add (Symbols *syms, TrieChar c)
  *    PRIVATE DATA DEFINITONS   *
  *------------------------------*/
 
-typedef struct {
-    TrieIndex   base;
-    TrieIndex   check;
-} DACell;
-
-struct _DArray {
-    TrieIndex   num_cells;
-    DACell     *cells;
-};
+/* Child links of a node, kept as labels rather than indices so that they
+ * survive relocation. Children of a node form a list sorted by label:
+ * 'child' of the parent cell is the first label, and 'sibling' of each child
+ * cell is the next label, or 0 at the end of the list. A child label 0 is
+ * ambiguous with "no child", and is resolved by testing CHECK.
+ */
+typedef struct _DALinks {
+    TrieChar    child;
+    TrieChar    sibling;
+} DALinks;
+
+/* Free cells are tracked in a bitmap with one bit set per free cell, so
+ * that a symbol set can be tested against 64 candidate bases at a time.
+ * Bits past the end of the pool are kept set, as those cells are free
+ * once the pool is extended over them.
+ *
+ * The pool is also divided into blocks of DA_BLOCK_SIZE cells. Blocks
+ * having free cells are kept in one of two circular lists, searched for
+ * bases in order. Open blocks are tried for any symbol set. A block that
+ * fails to fit a set is closed, and closed blocks are only tried for
+ * single symbols until they gain another free cell, so that a search does
+ * not keep visiting nearly full blocks. 'reject' remembers the smallest
+ * symbol set that failed to fit in the block since it last gained a free
+ * cell.
+ */
+typedef struct _DABlock {
+    TrieIndex   prev;
+    TrieIndex   next;
+    short       num;
+    short       reject;
+    Bool        is_closed;
+} DABlock;
 
 /*-----------------------------*
  *    METHODS IMPLEMENTAIONS   *
@@ -150,25 +206,59 @@ struct _DArray {
 
 /* DA Header:
  * - Cell 0: SIGNATURE, number of cells
- * - Cell 1: free circular-list pointers
+ * - Cell 1: free circular-list pointers (in file only)
  * - Cell 2: root node
  * - Cell 3: DA pool begin
  */
 #define DA_POOL_BEGIN 3
 
+#define DA_BLOCK_SIZE           256
+#define da_num_blocks(n)        (((n) + DA_BLOCK_SIZE - 1) / DA_BLOCK_SIZE)
+#define da_block_of(cell)       ((cell) / DA_BLOCK_SIZE)
+
+/* free_map words, padded for windows reaching TRIE_CHAR_MAX cells past
+ * the last candidate base */
+#define da_num_map_words(n)     ((n) / 64 + 7)
+#define da_map_set(d,cell)      ((d)->free_map[(cell) / 64] |=  \
+                                 ((uint64_t) 1 << ((cell) % 64)))
+#define da_map_clear(d,cell)    ((d)->free_map[(cell) / 64] &= \
+                                 ~((uint64_t) 1 << ((cell) % 64)))
+
+#if defined(__GNUC__)
+#  define da_ctz64(x)           __builtin_ctzll (x)
+#else
+static int
+da_ctz64 (uint64_t x)
+{
+    int n = 0;
+
+    while (!(x & 1)) {
+        x >>= 1;
+        ++n;
+    }
+    return n;
+}
+#endif
+
 DArray *
 da_new ()
 {
     DArray     *d;
 
-    d = (DArray *) malloc (sizeof (DArray));
+    d = (DArray *) calloc (1, sizeof (DArray));
     if (!d)
         return NULL;
 
-    d->num_cells = DA_POOL_BEGIN;
-    d->cells     = (DACell *) malloc (d->num_cells * sizeof (DACell));
-    if (!d->cells)
+    if (!da_set_alloc (d, DA_BLOCK_SIZE))
         goto exit_da_created;
+    d->num_cells = DA_POOL_BEGIN;
+    memset (d->links, 0, d->num_cells * sizeof (DALinks));
+    da_map_clear (d, 0);
+    da_map_clear (d, 1);
+    da_map_clear (d, 2);
+    d->blocks[0].num    = 0;
+    d->blocks[0].reject = DA_BLOCK_SIZE + 1;
+    d->open_blocks = d->closed_blocks = -1;
     d->cells[0].base = DA_SIGNATURE;
     d->cells[0].check = d->num_cells;
     d->cells[1].base = -1;
@@ -179,7 +269,7 @@ da_new ()
     return d;
 
 exit_da_created:
-    free (d);
+    da_free (d);
     return NULL;
 }
 
@@ -197,15 +287,15 @@ da_read (FILE *file)
         return NULL;
     }
 
-    d = (DArray *) malloc (sizeof (DArray));
+    d = (DArray *) calloc (1, sizeof (DArray));
     if (!d)
         return NULL;
 
     /* read number of cells */
-    file_read_int32 (file, &d->num_cells);
-    d->cells     = (DACell *) malloc (d->num_cells * sizeof (DACell));
-    if (!d->cells)
+    file_read_int32 (file, &n);
+    if (n < DA_POOL_BEGIN || !da_set_alloc (d, n))
         goto exit_da_created;
+    d->num_cells = n;
     d->cells[0].base = DA_SIGNATURE;
     d->cells[0].check= d->num_cells;
     for (n = 1; n < d->num_cells; n++) {
@@ -213,28 +303,199 @@ da_read (FILE *file)
         file_read_int32 (file, &d->cells[n].check);
     }
 
+    /* rebuild child links; scanning backward prepends children of each
+     * node in descending label order, so the lists come out sorted
+     */
+    memset (d->links, 0, d->num_cells * sizeof (DALinks));
+    for (n = d->num_cells - 1; n >= DA_POOL_BEGIN; n--) {
+        TrieIndex   parent = d->cells[n].check;
+
+        if (parent > 0) {
+            d->links[n].sibling = d->links[parent].child;
+            d->links[parent].child = (TrieChar) (n - d->cells[parent].base);
+        }
+    }
+
+    /* rebuild free cell map and blocks from the free cells, ignoring the
+     * stored list, then round the pool up to whole blocks
+     */
+    for (n = 0; n < d->num_cells; n++)
+        da_map_clear (d, n);
+    for (n = 0; n < da_num_blocks (d->num_cells); n++) {
+        d->blocks[n].num    = 0;
+        d->blocks[n].reject = DA_BLOCK_SIZE + 1;
+    }
+    d->open_blocks = d->closed_blocks = -1;
+    for (n = DA_POOL_BEGIN; n < d->num_cells; n++) {
+        if (d->cells[n].check < 0)
+            da_free_cell (d, n);
+    }
+    if (!da_extend_pool (d, da_num_blocks (d->num_cells) * DA_BLOCK_SIZE - 1))
+        goto exit_da_created;
+
     return d;
 
 exit_da_created:
-    free (d);
+    da_free (d);
     return NULL;
 }
 
 void
 da_free (DArray *d)
 {
+    free (d->blocks);
+    free (d->free_map);
+    free (d->links);
     free (d->cells);
+    free (d->weights);
     free (d);
 }
 
+Bool
+da_reserve (DArray *d, TrieIndex num_cells)
+{
+    if (num_cells <= d->alloc_cells)
+        return TRUE;
+    return da_set_alloc (d, num_cells);
+}
+
+Bool
+da_keep_weights (DArray *d)
+{
+    TrieIndex   i;
+
+    if (d->weights)
+        return TRUE;
+
+    d->weights = (int64_t *) malloc (d->alloc_cells * sizeof (int64_t));
+    if (!d->weights)
+        return FALSE;
+    for (i = 0; i < d->alloc_cells; i++)
+        d->weights[i] = DA_WEIGHT_NONE;
+
+    return TRUE;
+}
+
+DArray *
+da_compact (const DArray *d, DAMapFunc map_func, void *user_data)
+{
+    DArray     *c;
+    TrieIndex  *queue;
+    TrieIndex   head, tail;
+
+    c = da_new ();
+    if (!c)
+        return NULL;
+
+    /* pairs of (old state, new state), in breadth-first order */
+    queue = (TrieIndex *) malloc (2 * d->num_cells * sizeof (TrieIndex));
+    if (!queue)
+        goto exit_da_created;
+
+    head = tail = 0;
+    queue[tail++] = da_get_root (d);
+    queue[tail++] = da_get_root (c);
+    while (head < tail) {
+        TrieIndex   old_s, new_s, old_base, new_base;
+        Symbols    *symbols;
+        short       i;
+
+        old_s = queue[head++];
+        new_s = queue[head++];
+        old_base = da_get_base (d, old_s);
+
+        if (old_base < 0) {
+            TrieIndex   tail_index;
+
+            tail_index = map_func (-old_base, user_data);
+            if (TRIE_INDEX_ERROR == tail_index)
+                goto exit_queue_created;
+            da_set_base (c, new_s, -tail_index);
+            continue;
+        }
+
+        if (da_first_child (d, old_s) < 0) {
+            da_set_base (c, new_s, DA_POOL_BEGIN);
+            continue;
+        }
+
+        symbols = da_output_symbols (d, old_s);
+        new_base = da_place_symbols (c, new_s, symbols);
+        if (TRIE_INDEX_ERROR == new_base) {
+            symbols_free (symbols);
+            goto exit_queue_created;
+        }
+        for (i = 0; i < symbols_num (symbols); i++) {
+            queue[tail++] = old_base + symbols_get (symbols, i);
+            queue[tail++] = new_base + symbols_get (symbols, i);
+        }
+        symbols_free (symbols);
+    }
+    free (queue);
+
+    /* shrink to fit */
+    if (!da_set_alloc (c, c->num_cells))
+        goto exit_da_created;
+
+    return c;
+
+exit_queue_created:
+    free (queue);
+exit_da_created:
+    da_free (c);
+    return NULL;
+}
+
+/* The file format keeps all free cells in a single circular list sorted
+ * by index and headed at cell 1, which is regenerated on the fly here.
+ */
 int
 da_write (const DArray *d, FILE *file)
 {
-    TrieIndex   i;
+    TrieIndex   i, prev_free, next_free;
 
-    for (i = 0; i < d->num_cells; i++) {
-        if (!file_write_int32 (file, d->cells[i].base) ||
-            !file_write_int32 (file, d->cells[i].check))
+    for (next_free = DA_POOL_BEGIN; next_free < d->num_cells; next_free++) {
+        if (d->cells[next_free].check < 0)
+            break;
+    }
+    if (next_free == d->num_cells)
+        next_free = 1;
+    for (prev_free = d->num_cells - 1; prev_free >= DA_POOL_BEGIN; prev_free--) {
+        if (d->cells[prev_free].check < 0)
+            break;
+    }
+    if (prev_free < DA_POOL_BEGIN)
+        prev_free = 1;
+
+    if (!file_write_int32 (file, DA_SIGNATURE) ||
+        !file_write_int32 (file, d->num_cells) ||
+        !file_write_int32 (file, -prev_free) ||
+        !file_write_int32 (file, -next_free) ||
+        !file_write_int32 (file, d->cells[2].base) ||
+        !file_write_int32 (file, d->cells[2].check))
+    {
+        return -1;
+    }
+
+    prev_free = 1;
+    for (i = DA_POOL_BEGIN; i < d->num_cells; i++) {
+        TrieIndex   base, check;
+
+        base  = d->cells[i].base;
+        check = d->cells[i].check;
+        if (check < 0) {
+            for (next_free = i + 1; next_free < d->num_cells; next_free++) {
+                if (d->cells[next_free].check < 0)
+                    break;
+            }
+            if (next_free == d->num_cells)
+                next_free = 1;
+            base  = -prev_free;
+            check = -next_free;
+            prev_free = i;
+        }
+        if (!file_write_int32 (file, base) ||
+            !file_write_int32 (file, check))
         {
             return -1;
         }
@@ -313,7 +574,27 @@ da_insert_branch (DArray *d, TrieIndex s, TrieChar c)
          */
         if (base > TRIE_INDEX_MAX - c || !da_check_free_cell (d, next)) {
             Symbols    *symbols;
-            TrieIndex   new_base;
+            TrieIndex   new_base, owner;
+
+            /* if the cell belongs to a node with fewer children, move that
+             * node instead, unless it lies on the path to s, whose indices
+             * the caller may be holding
+             */
+            owner = (base > TRIE_INDEX_MAX - c) ? -1 : da_get_check (d, next);
+            if (owner > 0
+                && da_num_children (d, owner) <= da_num_children (d, s)
+                && !da_is_ancestor (d, owner, s))
+            {
+                symbols = da_output_symbols (d, owner);
+                new_base = da_find_free_base (d, symbols);
+                symbols_free (symbols);
+
+                if (TRIE_INDEX_ERROR == new_base)
+                    return TRIE_INDEX_ERROR;
+
+                da_relocate_base (d, owner, new_base);
+                goto insert;
+            }
 
             /* relocate BASE[s] */
             symbols = da_output_symbols (d, s);
@@ -342,12 +623,60 @@ da_insert_branch (DArray *d, TrieIndex s, TrieChar c)
         da_set_base (d, s, new_base);
         next = new_base + c;
     }
+
+insert:
     da_alloc_cell (d, next);
+    da_link_child (d, s, c);
     da_set_check (d, next, s);
 
     return next;
 }
 
+TrieIndex
+da_insert_branches (DArray *d, TrieIndex s, const TrieChar *chars, int num_chars)
+{
+    Symbols    *symbols;
+    TrieIndex   base;
+    int         i;
+
+    if (num_chars <= 0 || da_first_child (d, s) >= 0)
+        return TRIE_INDEX_ERROR;
+
+    symbols = symbols_new ();
+    if (!symbols)
+        return TRIE_INDEX_ERROR;
+    for (i = 0; i < num_chars; i++)
+        symbols_add_fast (symbols, chars[i]);
+
+    base = da_place_symbols (d, s, symbols);
+    symbols_free (symbols);
+
+    return base;
+}
+
+int
+da_first_child (const DArray *d, TrieIndex s)
+{
+    TrieIndex   base;
+    TrieChar    c;
+
+    base = da_get_base (d, s);
+    if (base <= 0)
+        return -1;
+
+    c = d->links[s].child;
+    return (da_get_check (d, base + c) == s) ? c : -1;
+}
+
+int
+da_next_child (const DArray *d, TrieIndex s, TrieChar c)
+{
+    TrieChar    next;
+
+    next = d->links[da_get_base (d, s) + c].sibling;
+    return next ? next : -1;
+}
+
 static Bool
 da_check_free_cell (DArray         *d,
                     TrieIndex       s)
@@ -356,23 +685,86 @@ da_check_free_cell (DArray         *d,
 }
 
 static Bool
-da_has_children    (DArray         *d,
+da_has_children    (const DArray   *d,
+                    TrieIndex       s)
+{
+    return da_first_child (d, s) >= 0;
+}
+
+static int
+da_num_children    (const DArray   *d,
                     TrieIndex       s)
+{
+    int     n, c;
+
+    n = 0;
+    for (c = da_first_child (d, s); c >= 0; c = da_next_child (d, s, c))
+        ++n;
+    return n;
+}
+
+/* whether a is a proper ancestor of s */
+static Bool
+da_is_ancestor     (const DArray   *d,
+                    TrieIndex       a,
+                    TrieIndex       s)
+{
+    TrieIndex   root;
+
+    root = da_get_root (d);
+    while (s != root) {
+        s = da_get_check (d, s);
+        if (s == a)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/* must be called before CHECK of the new child cell is set */
+static void
+da_link_child      (DArray         *d,
+                    TrieIndex       s,
+                    TrieChar        c)
 {
     TrieIndex   base;
-    TrieIndex   c, max_c;
+    int         first;
+    TrieChar    p;
 
     base = da_get_base (d, s);
-    if (TRIE_INDEX_ERROR == base || base < 0)
-        return FALSE;
+    first = da_first_child (d, s);
 
-    max_c = MIN_VAL (TRIE_CHAR_MAX, TRIE_INDEX_MAX - base);
-    for (c = 0; c < max_c; c++) {
-        if (da_get_check (d, base + c) == s)
-            return TRUE;
+    if (first < 0 || c < first) {
+        d->links[base + c].sibling = (first < 0) ? 0 : (TrieChar) first;
+        d->links[s].child = c;
+        return;
     }
 
-    return FALSE;
+    p = (TrieChar) first;
+    while (0 != d->links[base + p].sibling && d->links[base + p].sibling < c)
+        p = d->links[base + p].sibling;
+    d->links[base + c].sibling = d->links[base + p].sibling;
+    d->links[base + p].sibling = c;
+}
+
+static void
+da_unlink_child    (DArray         *d,
+                    TrieIndex       s,
+                    TrieChar        c)
+{
+    TrieIndex   base;
+    TrieChar    p;
+
+    base = da_get_base (d, s);
+
+    if (d->links[s].child == c) {
+        d->links[s].child = d->links[base + c].sibling;
+        return;
+    }
+
+    p = d->links[s].child;
+    while (d->links[base + p].sibling != c)
+        p = d->links[base + p].sibling;
+    d->links[base + p].sibling = d->links[base + c].sibling;
 }
 
 static Symbols *
@@ -380,17 +772,12 @@ da_output_symbols  (const DArray   *d,
                     TrieIndex       s)
 {
     Symbols    *syms;
-    TrieIndex   base;
-    TrieIndex   c, max_c;
+    int         c;
 
     syms = symbols_new ();
 
-    base = da_get_base (d, s);
-    max_c = MIN_VAL (TRIE_CHAR_MAX, TRIE_INDEX_MAX - base);
-    for (c = 0; c < max_c; c++) {
-        if (da_get_check (d, base + c) == s)
-            symbols_add_fast (syms, (TrieChar) c);
-    }
+    for (c = da_first_child (d, s); c >= 0; c = da_next_child (d, s, c))
+        symbols_add_fast (syms, (TrieChar) c);
 
     return syms;
 }
@@ -437,57 +824,141 @@ static TrieIndex
 da_find_free_base  (DArray         *d,
                     const Symbols  *symbols)
 {
-    TrieChar        first_sym;
-    TrieIndex       s;
+    TrieChar        first_sym, last_sym;
+    short           num_syms;
+    TrieIndex       block, next, last, base;
 
-    /* find first free cell that is beyond the first symbol */
     first_sym = symbols_get (symbols, 0);
-    s = -da_get_check (d, da_get_free_list (d));
-    while (s != da_get_free_list (d)
-           && s < (TrieIndex) first_sym + DA_POOL_BEGIN)
-    {
-        s = -da_get_check (d, s);
-    }
-    if (s == da_get_free_list (d)) {
-        for (s = first_sym + DA_POOL_BEGIN; ; ++s) {
-            if (!da_extend_pool (d, s))
-                return TRIE_INDEX_ERROR;
-            if (da_get_check (d, s) < 0)
+    num_syms  = symbols_num (symbols);
+    last_sym  = symbols_get (symbols, num_syms - 1);
+
+    /* single symbols go into closed blocks first */
+    block = (1 == num_syms) ? d->closed_blocks : -1;
+    if (block >= 0) {
+        last = d->blocks[block].prev;
+        for (;;) {
+            if ((base = da_fit_block (d, block, symbols)) != TRIE_INDEX_ERROR)
+                goto found;
+            if (block == last)
                 break;
+            block = d->blocks[block].next;
         }
     }
 
-    /* search for next free cell that fits the symbols set */
-    while (!da_fit_symbols (d, s - first_sym, symbols)) {
-        /* extend pool before getting exhausted */
-        if (-da_get_check (d, s) == da_get_free_list (d)) {
-            if (!da_extend_pool (d, d->num_cells))
-                return TRIE_INDEX_ERROR;
+    block = d->open_blocks;
+    if (block >= 0) {
+        last = d->blocks[block].prev;
+        for (;;) {
+            next = d->blocks[block].next;
+            if (d->blocks[block].num >= num_syms
+                && d->blocks[block].reject > num_syms)
+            {
+                if ((base = da_fit_block (d, block, symbols)) != TRIE_INDEX_ERROR)
+                    goto found;
+
+                d->blocks[block].reject = num_syms;
+                da_pop_block (d, &d->open_blocks, block);
+                da_push_block (d, &d->closed_blocks, block);
+                d->blocks[block].is_closed = TRUE;
+            }
+            if (block == last)
+                break;
+            block = next;
         }
+    }
+
+    /* no fit in the pool, place the symbols past its end */
+    base = MAX_VAL (d->num_cells - first_sym, DA_POOL_BEGIN);
+
+found:
+    if (!da_extend_pool (d, base + last_sym))
+        return TRIE_INDEX_ERROR;
 
-        s = -da_get_check (d, s);
+    return base;
+}
+
+/* Give childless state s a base holding all of the sorted symbols as
+ * children, linking them in one pass.
+ */
+static TrieIndex
+da_place_symbols   (DArray         *d,
+                    TrieIndex       s,
+                    const Symbols  *symbols)
+{
+    TrieIndex   base;
+    short       i, n;
+
+    base = da_find_free_base (d, symbols);
+    if (TRIE_INDEX_ERROR == base)
+        return TRIE_INDEX_ERROR;
+
+    da_set_base (d, s, base);
+    n = symbols_num (symbols);
+    d->links[s].child = symbols_get (symbols, 0);
+    for (i = 0; i < n; i++) {
+        TrieIndex   next = base + symbols_get (symbols, i);
+
+        da_alloc_cell (d, next);
+        d->links[next].sibling = (i + 1 < n) ? symbols_get (symbols, i + 1)
+                                             : 0;
+        da_set_check (d, next, s);
     }
 
-    return s - first_sym;
+    return base;
 }
 
-static Bool
-da_fit_symbols     (DArray         *d,
+/* Try bases that put the first symbol in the given block, 64 at a time.
+ * Returns the lowest fitting base, or TRIE_INDEX_ERROR.
+ */
+static TrieIndex
+da_fit_block       (const DArray   *d,
+                    TrieIndex       block,
+                    const Symbols  *symbols)
+{
+    TrieIndex   lo, base;
+
+    lo = MAX_VAL (block * DA_BLOCK_SIZE - symbols_get (symbols, 0), 0);
+    for (base = lo; base < lo + DA_BLOCK_SIZE; base += 64) {
+        uint64_t    fits;
+
+        fits = da_fit_symbols (d, base, symbols);
+        if (base < DA_POOL_BEGIN)
+            fits &= ~(uint64_t) 0 << (DA_POOL_BEGIN - base);
+        if (fits)
+            return base + da_ctz64 (fits);
+    }
+
+    return TRIE_INDEX_ERROR;
+}
+
+/* Returns a mask with bit i set if all symbols fit at base (base + i).
+ * Cells past the end of the pool count as free.
+ */
+static uint64_t
+da_fit_symbols     (const DArray   *d,
                     TrieIndex       base,
                     const Symbols  *symbols)
 {
+    uint64_t    fits;
     int         i;
 
-    for (i = 0; i < symbols_num (symbols); i++) {
-        TrieChar    sym = symbols_get (symbols, i);
+    fits = ~(uint64_t) 0;
+    for (i = 0; fits && i < symbols_num (symbols); i++) {
+        TrieIndex   pos;
+        int         shift;
+        uint64_t    window;
 
-        /* if (base + sym) > TRIE_INDEX_MAX which means it's overflow,
-         * or cell [base + sym] is not free, the symbol is not fit.
-         */
-        if (base > TRIE_INDEX_MAX - sym || !da_check_free_cell (d, base + sym))
-            return FALSE;
+        /* the 64 map bits from cell (base + sym) onward */
+        pos    = base + symbols_get (symbols, i);
+        shift  = pos % 64;
+        window = d->free_map[pos / 64] >> shift;
+        if (shift)
+            window |= d->free_map[pos / 64 + 1] << (64 - shift);
+
+        fits &= window;
     }
-    return TRUE;
+
+    return fits;
 }
 
 static void
@@ -509,10 +980,13 @@ da_relocate_base   (DArray         *d,
         new_next = new_base + symbols_get (symbols, i);
         old_next_base = da_get_base (d, old_next);
 
-        /* allocate new next node and copy BASE value */
+        /* allocate new next node and copy BASE value and links */
         da_alloc_cell (d, new_next);
         da_set_check (d, new_next, s);
         da_set_base (d, new_next, old_next_base);
+        d->links[new_next] = d->links[old_next];
+        if (d->weights)
+            d->weights[new_next] = d->weights[old_next];
 
         /* old_next node is now moved to new_next
          * so, all cells belonging to old_next
@@ -520,12 +994,12 @@ da_relocate_base   (DArray         *d,
          */
         /* preventing the case of TAIL pointer */
         if (old_next_base > 0) {
-            TrieIndex   c, max_c;
+            int     c;
 
-            max_c = MIN_VAL (TRIE_CHAR_MAX, TRIE_INDEX_MAX - old_next_base);
-            for  (c = 0; c < max_c; c++) {
-                if (da_get_check (d, old_next_base + c) == old_next)
-                    da_set_check (d, old_next_base + c, new_next);
+            for (c = da_first_child (d, old_next); c >= 0;
+                 c = da_next_child (d, old_next, c))
+            {
+                da_set_check (d, old_next_base + c, new_next);
             }
         }
 
@@ -543,32 +1017,38 @@ static Bool
 da_extend_pool     (DArray         *d,
                     TrieIndex       to_index)
 {
-    TrieIndex   new_begin;
+    TrieIndex   new_begin, new_num_cells;
     TrieIndex   i;
-    TrieIndex   free_tail;
 
-    if (to_index <= 0 || TRIE_INDEX_MAX <= to_index)
+    if (to_index <= 0 || TRIE_INDEX_MAX - DA_BLOCK_SIZE <= to_index)
         return FALSE;
 
     if (to_index < d->num_cells)
         return TRUE;
 
-    d->cells = (DACell *) realloc (d->cells, (to_index + 1) * sizeof (DACell));
-    new_begin = d->num_cells;
-    d->num_cells = to_index + 1;
+    /* grow by whole blocks, reallocating geometrically */
+    new_num_cells = (da_block_of (to_index) + 1) * DA_BLOCK_SIZE;
+    if (new_num_cells > d->alloc_cells) {
+        TrieIndex   new_alloc;
 
-    /* initialize new free list */
-    for (i = new_begin; i < to_index; i++) {
-        da_set_check (d, i, -(i + 1));
-        da_set_base (d, i + 1, -i);
+        new_alloc = (d->alloc_cells < TRIE_INDEX_MAX / 2)
+                        ? 2 * d->alloc_cells : TRIE_INDEX_MAX;
+        if (!da_set_alloc (d, MAX_VAL (new_alloc, new_num_cells)))
+            return FALSE;
+    }
+    for (i = da_num_blocks (d->num_cells);
+         i < da_num_blocks (new_num_cells);
+         i++)
+    {
+        d->blocks[i].num    = 0;
+        d->blocks[i].reject = DA_BLOCK_SIZE + 1;
     }
+    new_begin = d->num_cells;
+    d->num_cells = new_num_cells;
 
-    /* merge the new circular list to the old */
-    free_tail = -da_get_base (d, da_get_free_list (d));
-    da_set_check (d, free_tail, -new_begin);
-    da_set_base (d, new_begin, -free_tail);
-    da_set_check (d, to_index, -da_get_free_list (d));
-    da_set_base (d, da_get_free_list (d), -to_index);
+    /* add the new cells to the free pool */
+    for (i = new_begin; i < new_num_cells; i++)
+        da_free_cell (d, i);
 
     /* update header cell */
     d->cells[0].check = d->num_cells;
@@ -576,6 +1056,64 @@ da_extend_pool     (DArray         *d,
     return TRUE;
 }
 
+/* Resize the per-cell arrays to hold alloc_cells cells. Map words past
+ * the old allocation are set, as they are past the end of the pool.
+ */
+static Bool
+da_set_alloc       (DArray         *d,
+                    TrieIndex       alloc_cells)
+{
+    DACell     *cells;
+    DALinks    *links;
+    uint64_t   *free_map;
+    DABlock    *blocks;
+    TrieIndex   old_cells, old_words, i;
+
+    old_cells = d->cells ? d->alloc_cells + DA_SENTINEL_CELLS : 0;
+    old_words = d->free_map ? da_num_map_words (d->alloc_cells) : 0;
+
+    cells = (DACell *) realloc (d->cells, (alloc_cells + DA_SENTINEL_CELLS)
+                                          * sizeof (DACell));
+    if (!cells)
+        return FALSE;
+    d->cells = cells;
+    for (i = old_cells; i < alloc_cells + DA_SENTINEL_CELLS; i++)
+        d->cells[i].base = d->cells[i].check = -1;
+
+    links = (DALinks *) realloc (d->links, alloc_cells * sizeof (DALinks));
+    if (!links)
+        return FALSE;
+    d->links = links;
+
+    if (d->weights) {
+        int64_t    *weights;
+
+        weights = (int64_t *) realloc (d->weights,
+                                       alloc_cells * sizeof (int64_t));
+        if (!weights)
+            return FALSE;
+        d->weights = weights;
+    }
+
+    free_map = (uint64_t *) realloc (d->free_map,
+                                     da_num_map_words (alloc_cells)
+                                     * sizeof (uint64_t));
+    if (!free_map)
+        return FALSE;
+    d->free_map = free_map;
+    for (i = old_words; i < da_num_map_words (alloc_cells); i++)
+        d->free_map[i] = ~(uint64_t) 0;
+
+    blocks = (DABlock *) realloc (d->blocks, da_num_blocks (alloc_cells)
+                                             * sizeof (DABlock));
+    if (!blocks)
+        return FALSE;
+    d->blocks = blocks;
+
+    d->alloc_cells = alloc_cells;
+    return TRUE;
+}
+
 void
 da_prune (DArray *d, TrieIndex s)
 {
@@ -589,6 +1127,7 @@ da_prune_upto (DArray *d, TrieIndex p, TrieIndex s)
         TrieIndex   parent;
 
         parent = da_get_check (d, s);
+        da_unlink_child (d, parent, (TrieChar) (s - da_get_base (d, parent)));
         da_free_cell (d, s);
         s = parent;
     }
@@ -598,34 +1137,80 @@ static void
 da_alloc_cell      (DArray         *d,
                     TrieIndex       cell)
 {
-    TrieIndex   prev, next;
-
-    prev = -da_get_base (d, cell);
-    next = -da_get_check (d, cell);
-
-    /* remove the cell from free list */
-    da_set_check (d, prev, -next);
-    da_set_base (d, next, -prev);
+    TrieIndex   block;
+
+    block = da_block_of (cell);
+    da_map_clear (d, cell);
+    if (0 == --d->blocks[block].num) {
+        da_pop_block (d, d->blocks[block].is_closed ? &d->closed_blocks
+                                                    : &d->open_blocks,
+                      block);
+    }
 }
 
 static void
 da_free_cell       (DArray         *d,
                     TrieIndex       cell)
 {
-    TrieIndex   i, prev;
+    TrieIndex   block;
+
+    block = da_block_of (cell);
+    da_set_check (d, cell, -1);
+    da_set_base (d, cell, -1);
+    da_map_set (d, cell);
+    if (d->weights)
+        d->weights[cell] = DA_WEIGHT_NONE;
+
+    /* a lone free cell only takes single symbols; from two on, the block
+     * is worth trying for any set again */
+    if (0 == d->blocks[block].num++) {
+        da_push_block (d, &d->closed_blocks, block);
+        d->blocks[block].is_closed = TRUE;
+    } else if (d->blocks[block].is_closed) {
+        da_pop_block (d, &d->closed_blocks, block);
+        da_push_block (d, &d->open_blocks, block);
+        d->blocks[block].is_closed = FALSE;
+    }
+    d->blocks[block].reject = DA_BLOCK_SIZE + 1;
+}
 
-    /* find insertion point */
-    i = -da_get_check (d, da_get_free_list (d));
-    while (i != da_get_free_list (d) && i < cell)
-        i = -da_get_check (d, i);
+static void
+da_push_block      (DArray         *d,
+                    TrieIndex      *list,
+                    TrieIndex       block)
+{
+    TrieIndex   head, tail;
+
+    if (*list < 0) {
+        d->blocks[block].prev = d->blocks[block].next = block;
+        *list = block;
+    } else {
+        head = *list;
+        tail = d->blocks[head].prev;
+        d->blocks[block].prev = tail;
+        d->blocks[block].next = head;
+        d->blocks[tail].next = block;
+        d->blocks[head].prev = block;
+    }
+}
 
-    prev = -da_get_base (d, i);
+static void
+da_pop_block       (DArray         *d,
+                    TrieIndex      *list,
+                    TrieIndex       block)
+{
+    TrieIndex   prev, next;
 
-    /* insert cell before i */
-    da_set_check (d, cell, -i);
-    da_set_base (d, cell, -prev);
-    da_set_check (d, prev, -cell);
-    da_set_base (d, i, -cell);
+    prev = d->blocks[block].prev;
+    next = d->blocks[block].next;
+    if (next == block) {
+        *list = -1;
+    } else {
+        d->blocks[prev].next = next;
+        d->blocks[next].prev = prev;
+        if (*list == block)
+            *list = next;
+    }
 }
 
 Bool
@@ -8,6 +8,8 @@
 #ifndef __DARRAY_H
 #define __DARRAY_H
 
+#include <stdint.h>
+
 #include "triedefs.h"
 
 /**
@@ -15,11 +17,54 @@
  * @brief Double-array trie structure
  */
 
+/**
+ * @brief Double-array cell
+ */
+typedef struct {
+    TrieIndex   base;
+    TrieIndex   check;
+} DACell;
+
 /**
  * @brief Double-array structure type
  */
 typedef struct _DArray  DArray;
 
+/**
+ * @brief Number of free cells padding the cell array past the pool
+ *
+ * A child of any state falls within TRIE_CHAR_MAX cells past the state's
+ * BASE, which is itself inside the pool, so that walking from a valid
+ * state never reads past the cell array.
+ */
+#define DA_SENTINEL_CELLS   (TRIE_CHAR_MAX + 1)
+
+/* The structure is private to darray.c, and is only laid out here so that
+ * lookups can inline the unchecked accessors below.
+ *
+ * 'num_cells' is the size of the pool, and 'alloc_cells' the allocated
+ * length of the per-cell arrays, which grow geometrically ahead of it.
+ * 'cells' has DA_SENTINEL_CELLS more, and every cell past the pool is kept
+ * free. 'weights' is NULL unless weights are kept, and is as long as
+ * 'links' then.
+ */
+struct _DArray {
+    TrieIndex           num_cells;
+    TrieIndex           alloc_cells;
+    DACell             *cells;
+    struct _DALinks    *links;
+    uint64_t           *free_map;
+    struct _DABlock    *blocks;
+    TrieIndex           open_blocks;
+    TrieIndex           closed_blocks;
+    int64_t            *weights;
+};
+
+/**
+ * @brief Weight of a state with no weighted entry below it
+ */
+#define DA_WEIGHT_NONE      INT64_MIN
+
 /**
  * @brief Double-array entry enumeration function
  *
@@ -33,6 +78,17 @@ typedef Bool (*DAEnumFunc) (const TrieChar   *key,
                             TrieIndex         sep_node,
                             void             *user_data);
 
+/**
+ * @brief Double-array tail index mapping function
+ *
+ * @param tail_index : the tail index kept in a separate node
+ * @param user_data  : user-supplied data
+ *
+ * @return the tail index to keep in its place, TRIE_INDEX_ERROR to abort
+ */
+typedef TrieIndex (*DAMapFunc) (TrieIndex         tail_index,
+                                void             *user_data);
+
 
 /**
  * @brief Create a new double-array object
@@ -78,6 +134,50 @@ void     da_free (DArray *d);
 int      da_write (const DArray *d, FILE *file);
 
 
+/**
+ * @brief Reserve space in double-array data
+ *
+ * @param d         : the double-array data
+ * @param num_cells : the number of cells to make room for
+ *
+ * @return boolean indicating success
+ *
+ * Pre-allocate room for @a num_cells cells, so that the pool can grow to
+ * that size without reallocating. The pool itself is not extended.
+ */
+Bool     da_reserve (DArray *d, TrieIndex num_cells);
+
+/**
+ * @brief Keep a weight for each state of double-array data
+ *
+ * @param d : the double-array data
+ *
+ * @return boolean indicating success
+ *
+ * Allocate a weight for every cell, set to DA_WEIGHT_NONE. From then on,
+ * a state keeps its weight when relocated, and a freed cell has its weight
+ * set back to DA_WEIGHT_NONE; what the weights mean is up to the caller.
+ * Weights are not carried over by da_compact(), nor written to file.
+ */
+Bool     da_keep_weights (DArray *d);
+
+/**
+ * @brief Build a compacted copy of double-array data
+ *
+ * @param d         : the double-array data
+ * @param map_func  : the callback function to be called on each separate node
+ * @param user_data : user-supplied data to send as an argument to @a map_func
+ *
+ * @return a pointer to the new double-array, NULL on failure
+ *
+ * Build a new double-array holding the same states as @a d, placed
+ * breadth-first so that nodes near the root share cache lines, with the
+ * pool shrunk to fit. States are visited breadth-first, and the tail index
+ * of each separate node is replaced with what @a map_func returns for it.
+ */
+DArray * da_compact (const DArray *d, DAMapFunc map_func, void *user_data);
+
+
 /**
  * @brief Get root state
  *
@@ -170,6 +270,88 @@ Bool       da_is_walkable (DArray *d, TrieIndex s, TrieChar c);
 #define    da_is_walkable(d,s,c) \
     (da_get_check ((d), da_get_base ((d), (s)) + (c)) == (s))
 
+/**
+ * @brief Get BASE cell, unchecked
+ *
+ * Same as da_get_base(), without bounds checking, for use in lookup loops.
+ * @a s must be within the pool.
+ */
+#define    da_fast_get_base(d,s)    ((d)->cells[(s)].base)
+
+/**
+ * @brief Get CHECK cell, unchecked
+ *
+ * Same as da_get_check(), without bounds checking, for use in lookup loops.
+ * @a s must be within the pool, or be the BASE of a non-separate state in
+ * the pool plus a character.
+ */
+#define    da_fast_get_check(d,s)   ((d)->cells[(s)].check)
+
+/**
+ * @brief Get the number of cells in the pool
+ *
+ * Every state of the double array has an index below it, so it sizes
+ * arrays kept alongside the states.
+ */
+#define    da_get_num_cells(d)      ((d)->num_cells)
+
+/**
+ * @brief Tell whether weights are kept
+ */
+#define    da_has_weights(d)        (NULL != (d)->weights)
+
+/**
+ * @brief Get the weight of a state
+ *
+ * Weights must be kept, see da_keep_weights(), and @a s must be within
+ * the pool.
+ */
+#define    da_get_weight(d,s)       ((d)->weights[(s)])
+
+/**
+ * @brief Set the weight of a state
+ *
+ * Weights must be kept, see da_keep_weights(), and @a s must be within
+ * the pool.
+ */
+#define    da_set_weight(d,s,w)     ((d)->weights[(s)] = (w))
+
+/**
+ * @brief Prefetch a cell
+ *
+ * Hint that cell @a s, within the pool, is about to be read, so that a
+ * lookup can overlap the memory latency of several walks.
+ */
+#if defined(__GNUC__)
+#define    da_prefetch(d,s)         __builtin_prefetch (&(d)->cells[(s)])
+#else
+#define    da_prefetch(d,s)         ((void) 0)
+#endif
+
+/**
+ * @brief Get the first child of a node
+ *
+ * @param d : the double-array structure
+ * @param s : the state to get the child of
+ *
+ * @return the smallest label leaving @a s, or -1 if @a s has no children
+ *
+ * Children are kept in a sorted list per node, so that enumerating them
+ * costs the number of children rather than the alphabet size.
+ */
+int        da_first_child (const DArray *d, TrieIndex s);
+
+/**
+ * @brief Get the next child of a node
+ *
+ * @param d : the double-array structure
+ * @param s : the parent state
+ * @param c : the label of an existing child of @a s
+ *
+ * @return the next larger label leaving @a s, or -1 if @a c is the last
+ */
+int        da_next_child (const DArray *d, TrieIndex s, TrieChar c);
+
 /**
  * @brief Insert a branch from trie node
  *
@@ -185,6 +367,25 @@ Bool       da_is_walkable (DArray *d, TrieIndex s, TrieChar c);
  */
 TrieIndex  da_insert_branch (DArray *d, TrieIndex s, TrieChar c);
 
+/**
+ * @brief Insert all branches of a new node
+ *
+ * @param d         : the double-array structure
+ * @param s         : the childless state to add branches to
+ * @param chars     : the branch labels, in ascending order
+ * @param num_chars : the number of labels in @a chars
+ *
+ * @return the new BASE of @a s, or TRIE_INDEX_ERROR on failure
+ *
+ * Insert a child of @a s for each label in @a chars at once. The base is
+ * searched for only once for the whole set, and no state is relocated. The
+ * child of @a s labelled c is the returned base + c.
+ */
+TrieIndex  da_insert_branches (DArray         *d,
+                               TrieIndex       s,
+                               const TrieChar *chars,
+                               int             num_chars);
+
 /**
  * @brief Prune the single branch
  *
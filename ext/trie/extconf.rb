@@ -1,3 +1,3 @@
 require 'mkmf'
+have_func 'rb_enumeratorize_with_size_kw'
 create_makefile 'trie'
-
@@ -0,0 +1,253 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * scanner.c - multi-pattern scanner over a set of keys
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "trie-private.h"
+#include "scanner.h"
+#include "darray.h"
+
+/*----------------------------------*
+ *    INTERNAL TYPES DECLARATIONS   *
+ *----------------------------------*/
+
+/* 'fail', 'output' and 'key' have an entry for each cell of 'da'. 'output'
+ * is the nearest state ending a key along the failure links, the state
+ * itself included, or 0 if there is none. 'key' is 1 more than the number
+ * of the key a state ends, or 0.
+ */
+struct _Scanner {
+    DArray     *da;
+    TrieIndex  *fail;
+    TrieIndex  *output;
+    TrieIndex  *key;
+    size_t     *lens;
+    TrieData   *data;
+    size_t      num_keys;
+};
+
+/*-----------------------------------*
+ *    PRIVATE METHODS DECLARATIONS   *
+ *-----------------------------------*/
+
+static Bool     scanner_link_states (Scanner *scanner);
+
+/*-----------------------------*
+ *    METHODS IMPLEMENTAIONS   *
+ *-----------------------------*/
+
+Scanner *
+scanner_new (const TrieChar *keys[],
+             const size_t    lens[],
+             const TrieData  data[],
+             size_t          num_keys)
+{
+    Scanner    *scanner;
+    TrieIndex   root, s, num_cells;
+    size_t      i, j;
+
+    scanner = (Scanner *) calloc (1, sizeof (Scanner));
+    if (!scanner)
+        return NULL;
+
+    scanner->da = da_new ();
+    if (!scanner->da)
+        goto exit_scanner_created;
+    root = da_get_root (scanner->da);
+
+    /* lay out a state for each key byte */
+    for (i = 0; i < num_keys; i++) {
+        s = root;
+        for (j = 0; j < lens[i]; j++) {
+            if (da_walk (scanner->da, &s, keys[i][j]))
+                continue;
+            s = da_insert_branch (scanner->da, s, keys[i][j]);
+            if (TRIE_INDEX_ERROR == s)
+                goto exit_scanner_created;
+        }
+    }
+
+    /* the states only stay put once all are in */
+    num_cells = da_get_num_cells (scanner->da);
+    scanner->fail   = (TrieIndex *) malloc (num_cells * sizeof (TrieIndex));
+    scanner->output = (TrieIndex *) malloc (num_cells * sizeof (TrieIndex));
+    scanner->key    = (TrieIndex *) calloc (num_cells, sizeof (TrieIndex));
+    scanner->lens   = (size_t *) malloc (MAX_VAL (num_keys, 1)
+                                         * sizeof (size_t));
+    scanner->data   = (TrieData *) malloc (MAX_VAL (num_keys, 1)
+                                           * sizeof (TrieData));
+    if (!scanner->fail || !scanner->output || !scanner->key
+        || !scanner->lens || !scanner->data)
+    {
+        goto exit_scanner_created;
+    }
+
+    for (i = 0; i < num_keys; i++) {
+        if (0 == lens[i])
+            continue;
+
+        s = root;
+        for (j = 0; j < lens[i]; j++)
+            da_walk (scanner->da, &s, keys[i][j]);
+
+        if (!scanner->key[s]) {
+            scanner->key[s] = ++scanner->num_keys;
+            scanner->lens[scanner->num_keys - 1] = lens[i];
+        }
+        scanner->data[scanner->key[s] - 1] = data[i];
+    }
+
+    if (!scanner_link_states (scanner))
+        goto exit_scanner_created;
+
+    return scanner;
+
+exit_scanner_created:
+    scanner_free (scanner);
+    return NULL;
+}
+
+void
+scanner_free (Scanner *scanner)
+{
+    if (scanner->da)
+        da_free (scanner->da);
+    free (scanner->fail);
+    free (scanner->output);
+    free (scanner->key);
+    free (scanner->lens);
+    free (scanner->data);
+    free (scanner);
+}
+
+size_t
+scanner_num_keys (const Scanner *scanner)
+{
+    return scanner->num_keys;
+}
+
+TrieData
+scanner_get_data (const Scanner *scanner, size_t i)
+{
+    return scanner->data[i];
+}
+
+void
+scanner_start (const Scanner *scanner, ScannerState *s)
+{
+    s->state  = da_get_root (scanner->da);
+    s->offset = 0;
+}
+
+Bool
+scanner_scan (const Scanner    *scanner,
+              ScannerState     *s,
+              const TrieChar   *text,
+              size_t            len,
+              ScannerMatchFunc  match_func,
+              void             *user_data)
+{
+    const DArray   *da = scanner->da;
+    TrieIndex       root, state, base, m;
+    size_t          start, i, end, k;
+
+    root  = da_get_root (da);
+    state = s->state;
+    start = s->offset;
+    for (i = 0; i < len; i++) {
+        TrieChar    c = text[i];
+
+        /* follow the failure links until c can be walked, or to the root */
+        for (;;) {
+            base = da_fast_get_base (da, state);
+            if (base > 0 && da_fast_get_check (da, base + c) == state) {
+                state = base + c;
+                break;
+            }
+            if (root == state)
+                break;
+            state = scanner->fail[state];
+        }
+
+        m = scanner->output[state];
+        if (!m)
+            continue;
+
+        end = start + i + 1;
+        s->state  = state;
+        s->offset = end;
+        do {
+            k = scanner->key[m] - 1;
+            if (!(*match_func) (end - scanner->lens[k], scanner->lens[k],
+                                scanner->data[k], user_data))
+            {
+                return FALSE;
+            }
+            m = scanner->output[scanner->fail[m]];
+        } while (m);
+    }
+
+    s->state  = state;
+    s->offset = start + len;
+    return TRUE;
+}
+
+/* Set the failure and output links breadth first, so that those of the
+ * shorter prefixes they lead to are always set before.
+ */
+static Bool
+scanner_link_states (Scanner *scanner)
+{
+    const DArray   *da = scanner->da;
+    TrieIndex      *queue;
+    TrieIndex       root, s, t, f, g;
+    size_t          head, tail;
+    int             c;
+
+    queue = (TrieIndex *) malloc (da_get_num_cells (da) * sizeof (TrieIndex));
+    if (!queue)
+        return FALSE;
+
+    root = da_get_root (da);
+    scanner->fail[root] = root;
+    scanner->output[root] = 0;
+    head = tail = 0;
+    queue[tail++] = root;
+
+    while (head < tail) {
+        s = queue[head++];
+        for (c = da_first_child (da, s); c >= 0;
+             c = da_next_child (da, s, c))
+        {
+            t = s;
+            da_walk (da, &t, (TrieChar) c);
+
+            /* the longest proper suffix walkable on by c */
+            f = root;
+            if (s != root) {
+                for (g = scanner->fail[s]; ; g = scanner->fail[g]) {
+                    f = g;
+                    if (da_walk (da, &f, (TrieChar) c))
+                        break;
+                    f = root;
+                    if (root == g)
+                        break;
+                }
+            }
+
+            scanner->fail[t] = f;
+            scanner->output[t] = scanner->key[t] ? t : scanner->output[f];
+            queue[tail++] = t;
+        }
+    }
+
+    free (queue);
+    return TRUE;
+}
+
+/*
+vi:ts=4:ai:expandtab
+*/
@@ -0,0 +1,144 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * scanner.h - multi-pattern scanner over a set of keys
+ */
+
+#ifndef __SCANNER_H
+#define __SCANNER_H
+
+#include "triedefs.h"
+
+/**
+ * @file scanner.h
+ * @brief Aho-Corasick scanner for finding keys in a text
+ *
+ * A Scanner is an Aho-Corasick automaton over the bytes of a fixed set of
+ * keys. Its goto function is a double array with every key byte on a
+ * state of its own, and each state has a failure link to the state of its
+ * longest proper suffix that is also a key prefix, and an output link to
+ * the nearest state along the failure links that ends a key. A text is
+ * then matched against all the keys in a single pass.
+ *
+ * A Scanner is not changed by scanning, so one may be shared by any number
+ * of scans at once. The progress of a scan is kept in a ScannerState, so
+ * that a text may be fed in chunks.
+ */
+
+/**
+ * @brief Scanner data type
+ */
+typedef struct _Scanner  Scanner;
+
+/**
+ * @brief Progress of a scan
+ */
+typedef struct {
+    TrieIndex   state;      /**< automaton state after the bytes so far */
+    size_t      offset;     /**< number of bytes scanned so far */
+} ScannerState;
+
+/**
+ * @brief Scanner match callback
+ *
+ * @param start     : the offset of the first byte of the key in the text
+ * @param len       : the length of the key
+ * @param data      : the data of the key
+ * @param user_data : user-supplied data
+ *
+ * @return TRUE to go on scanning, FALSE to stop
+ */
+typedef Bool (*ScannerMatchFunc) (size_t      start,
+                                  size_t      len,
+                                  TrieData    data,
+                                  void       *user_data);
+
+/**
+ * @brief Create a scanner for a set of keys
+ *
+ * @param keys     : the keys
+ * @param lens     : the length of each key, in bytes
+ * @param data     : the data of each key
+ * @param num_keys : the number of keys
+ *
+ * @return a pointer to the new scanner, NULL on failure
+ *
+ * Build the automaton for the given keys. Empty keys are left out, as
+ * they would match everywhere. If a key is given more than once, its last
+ * data is kept.
+ */
+Scanner *   scanner_new (const TrieChar *keys[],
+                         const size_t    lens[],
+                         const TrieData  data[],
+                         size_t          num_keys);
+
+/**
+ * @brief Free a scanner
+ *
+ * @param scanner : the scanner
+ */
+void        scanner_free (Scanner *scanner);
+
+/**
+ * @brief Get the number of keys in a scanner
+ *
+ * @param scanner : the scanner
+ *
+ * @return the number of distinct keys the scanner looks for
+ */
+size_t      scanner_num_keys (const Scanner *scanner);
+
+/**
+ * @brief Get the data of a key in a scanner
+ *
+ * @param scanner : the scanner
+ * @param i       : the number of the key, below scanner_num_keys()
+ *
+ * @return the data of the key
+ *
+ * For callers that must keep hold of the data of the keys, e.g. to mark
+ * it for a garbage collector.
+ */
+TrieData    scanner_get_data (const Scanner *scanner, size_t i);
+
+/**
+ * @brief Start a scan
+ *
+ * @param scanner : the scanner
+ * @param s       : the scan state to set
+ *
+ * Set @a s to the start of a text.
+ */
+void        scanner_start (const Scanner *scanner, ScannerState *s);
+
+/**
+ * @brief Scan a chunk of text
+ *
+ * @param scanner    : the scanner
+ * @param s          : the scan state, as left by the previous chunk
+ * @param text       : the chunk
+ * @param len        : the length of the chunk, in bytes
+ * @param match_func : the callback to call on each match
+ * @param user_data  : user-supplied data to send to @a match_func
+ *
+ * @return FALSE if @a match_func stopped the scan, TRUE otherwise
+ *
+ * Feed the chunk through the automaton, calling @a match_func for every
+ * occurrence of every key, in the order of their ends, and the longest
+ * first of those ending at the same byte. Offsets count from the start of
+ * the text, so that keys spanning chunks are found as in a single text.
+ * @a s is brought up to date before each call of @a match_func, so that
+ * it is left after the byte the last match ended at if the scan is
+ * stopped, or is left by a longjmp() out of the callback.
+ */
+Bool        scanner_scan (const Scanner    *scanner,
+                          ScannerState     *s,
+                          const TrieChar   *text,
+                          size_t            len,
+                          ScannerMatchFunc  match_func,
+                          void             *user_data);
+
+#endif  /* __SCANNER_H */
+
+/*
+vi:ts=4:ai:expandtab
+*/
@@ -8,7 +8,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 
+#include "trie-private.h"
 #include "tail.h"
 #include "fileutils.h"
 
@@ -22,6 +24,13 @@
 
 static TrieIndex    tail_alloc_block (Tail *t);
 static void         tail_free_block (Tail *t, TrieIndex block);
+static Bool         tail_reserve_arena (Tail *t, size_t arena_size);
+static void         tail_drop_suffix (Tail *t, TrieIndex block);
+static Bool         tail_read_blocks_v1 (Tail *t, FILE *file);
+static Bool         tail_read_blocks (Tail *t, FILE *file);
+static int          tail_suffix_ref_cmp (const void *a, const void *b);
+static void         tail_link_free_blocks (Tail *t);
+static void         tail_shorten_suffixes (Tail *t);
 
 /* ==================== BEGIN IMPLEMENTATION PART ====================  */
 
@@ -33,33 +42,83 @@ static void         tail_free_block (Tail *t, TrieIndex block);
  *    PRIVATE DATA DEFINITONS   *
  *------------------------------*/
 
+#define TAIL_NO_SUFFIX      ((size_t) -1)
+#define TAIL_SHORT_SUFFIX   ((size_t) -2)
+#define TAIL_SHORT_SIZE     4
+#define TAIL_USED           (-1)
+#define TAIL_FREE_END       (-2)
+
+#define tail_is_in_arena(off)   ((off) < TAIL_SHORT_SUFFIX)
+
+/* 'next_free' is TAIL_USED for allocated blocks, and links free blocks
+ * into a stack ended by TAIL_FREE_END. 'suffix' is the offset of the
+ * null-terminated suffix in the arena, TAIL_SHORT_SUFFIX if it fits in
+ * 'short_suffix' instead, or TAIL_NO_SUFFIX. Short suffixes, which include
+ * the empty suffix of every key ending at a branch, thus take no arena
+ * space and are read from the block already fetched for the data;
+ * 'short_suffix' fills what would be padding after 'next_free'.
+ */
 typedef struct {
-    TrieIndex   next_free;
     TrieData    data;
-    TrieChar   *suffix;
+    size_t      suffix;
+    TrieIndex   next_free;
+    TrieChar    short_suffix[TAIL_SHORT_SIZE];
 } TailBlock;
 
+/* Suffixes are kept back to back in a single arena. Space given up by
+ * deleted and shortened suffixes is only counted in 'arena_garbage', and
+ * reclaimed by tail_pack_suffixes(). Packing also lets a suffix that ends
+ * another one point into its bytes; the first 'arena_shared' bytes may be
+ * shared this way, so they are never reclaimed on their own.
+ */
 struct _Tail {
     TrieIndex   num_tails;
+    TrieIndex   alloc_tails;
     TailBlock  *tails;
     TrieIndex   first_free;
+    TrieChar   *arena;
+    size_t      arena_len;
+    size_t      arena_size;
+    size_t      arena_garbage;
+    size_t      arena_shared;
+    Bool        raw_keys;
 };
 
+/* a live suffix, for sorting by its reverse */
+typedef struct {
+    const TrieChar *suffix;
+    size_t          len;
+    TrieIndex       block;
+} TailSuffixRef;
+
 /*-----------------------------*
  *    METHODS IMPLEMENTAIONS   *
  *-----------------------------*/
 
-#define TAIL_SIGNATURE      0xDFFCDFFC
+#define TAIL_SIGNATURE      0xDFFCDFFE
+#define TAIL_SIGNATURE_V2   0xDFFCDFFD
+#define TAIL_SIGNATURE_V1   0xDFFCDFFC
 #define TAIL_START_BLOCKNO  1
 
 /* Tail Header:
  * INT32: signature
- * INT32: pointer to first free slot
+ * INT32: pointer to first free slot (-2 for none)
  * INT32: number of tail blocks
+ * INT32: number of suffix bytes
  *
  * Tail Blocks:
- * INT32: pointer to next free block (-1 for allocated blocks)
+ * INT32: pointer to next free block (-1 for allocated blocks, -2 for the
+ *        last free block)
  * INT32: data for the key
+ * INT32: offset of the suffix in suffix bytes (-1 for none)
+ *
+ * Suffix Bytes:
+ * BYTES[number of suffix bytes]: '\0'-terminated suffixes, where a suffix
+ *                                may end within another one
+ *
+ * Version 2 files are laid out the same, but hold their keys unescaped,
+ * as do version 1 files. Those end the free list with 0, and have no
+ * suffix bytes block. Each of their tail blocks has instead:
  * INT16: length
  * BYTES[length]: suffix string (no terminating '\0')
  */
@@ -69,13 +128,14 @@ tail_new ()
 {
     Tail       *t;
 
-    t = (Tail *) malloc (sizeof (Tail));
+    t = (Tail *) calloc (1, sizeof (Tail));
     if (!t)
         return NULL;
 
-    t->first_free = 0;
-    t->num_tails  = 0;
-    t->tails      = NULL;
+    t->first_free  = TAIL_FREE_END;
+    t->num_tails   = 0;
+    t->alloc_tails = 0;
+    t->tails       = NULL;
 
     return t;
 }
@@ -85,56 +145,129 @@ tail_read (FILE *file)
 {
     long        save_pos;
     Tail       *t;
-    TrieIndex   i;
     uint32      sig;
+    int32       first_free;
+    Bool        ok;
 
     /* check signature */
     save_pos = ftell (file);
-    if (!file_read_int32 (file, (int32 *) &sig) || TAIL_SIGNATURE != sig) {
+    if (!file_read_int32 (file, (int32 *) &sig)
+        || (TAIL_SIGNATURE != sig && TAIL_SIGNATURE_V2 != sig
+            && TAIL_SIGNATURE_V1 != sig))
+    {
         fseek (file, save_pos, SEEK_SET);
         return NULL;
     }
 
-    t = (Tail *) malloc (sizeof (Tail));
+    t = tail_new ();
     if (!t)
         return NULL;
 
-    file_read_int32 (file, &t->first_free);
-    file_read_int32 (file, &t->num_tails);
-    t->tails = (TailBlock *) malloc (t->num_tails * sizeof (TailBlock));
-    if (!t->tails)
+    if (!file_read_int32 (file, &first_free) ||
+        !file_read_int32 (file, &t->num_tails) ||
+        t->num_tails < 0 ||
+        !tail_reserve (t, t->num_tails, 0))
+    {
         goto exit_tail_created;
+    }
+
+    ok = (TAIL_SIGNATURE_V1 == sig) ? tail_read_blocks_v1 (t, file)
+                                    : tail_read_blocks (t, file);
+    if (!ok)
+        goto exit_tail_created;
+    t->raw_keys = (TAIL_SIGNATURE != sig);
+
+    /* version 1 lists cannot tell block 0 from their end, so the free
+     * list is always rebuilt from the block marks
+     */
+    tail_link_free_blocks (t);
+    tail_shorten_suffixes (t);
+
+    return t;
+
+exit_tail_created:
+    tail_free (t);
+    return NULL;
+}
+
+static Bool
+tail_read_blocks (Tail *t, FILE *file)
+{
+    int32       arena_len;
+    TrieIndex   i;
+
+    if (!file_read_int32 (file, &arena_len) || arena_len < 0
+        || !tail_reserve_arena (t, arena_len))
+    {
+        return FALSE;
+    }
+
+    for (i = 0; i < t->num_tails; i++) {
+        int32   data, suffix;
+
+        if (!file_read_int32 (file, &t->tails[i].next_free) ||
+            !file_read_int32 (file, &data) ||
+            !file_read_int32 (file, &suffix) ||
+            suffix < -1 || suffix >= arena_len)
+        {
+            return FALSE;
+        }
+        t->tails[i].data = (TrieData) (long) data;
+        t->tails[i].suffix = (suffix < 0) ? TAIL_NO_SUFFIX : (size_t) suffix;
+    }
+
+    /* the last suffix must be terminated too */
+    if (arena_len > 0
+        && (!file_read_chars (file, (char *) t->arena, arena_len)
+            || '\0' != t->arena[arena_len - 1]))
+    {
+        return FALSE;
+    }
+    t->arena_len = t->arena_shared = arena_len;
+
+    return TRUE;
+}
+
+static Bool
+tail_read_blocks_v1 (Tail *t, FILE *file)
+{
+    TrieIndex   i;
+
     for (i = 0; i < t->num_tails; i++) {
+        int32   data;
         int16   length;
 
         file_read_int32 (file, &t->tails[i].next_free);
-        file_read_int32 (file, &t->tails[i].data);
+        file_read_int32 (file, &data);
+        t->tails[i].data = (TrieData) (long) data;
 
         file_read_int16 (file, &length);
-        t->tails[i].suffix    = (TrieChar *) malloc (length + 1);
+        if (length < 0
+            || !tail_reserve_arena (t, t->arena_len + length + 1))
+        {
+            return FALSE;
+        }
+        t->tails[i].suffix = t->arena_len;
         if (length > 0)
-            file_read_chars (file, (char *)t->tails[i].suffix, length);
-        t->tails[i].suffix[length] = '\0';
+            file_read_chars (file, (char *) t->arena + t->arena_len, length);
+        t->arena[t->arena_len + length] = '\0';
+        t->arena_len += length + 1;
     }
 
-    return t;
+    return TRUE;
+}
 
-exit_tail_created:
-    free (t);
-    return NULL;
+Bool
+tail_has_raw_keys (const Tail *t)
+{
+    return t->raw_keys;
 }
 
 void
 tail_free (Tail *t)
 {
-    TrieIndex   i;
-
-    if (t->tails) {
-        for (i = 0; i < t->num_tails; i++)
-            if (t->tails[i].suffix)
-                free (t->tails[i].suffix);
-        free (t->tails);
-    }
+    free (t->arena);
+    free (t->tails);
     free (t);
 }
 
@@ -142,28 +275,53 @@ int
 tail_write (const Tail *t, FILE *file)
 {
     TrieIndex   i;
+    size_t      len, short_len;
+
+    /* short suffixes are written after the arena, as if they were in it */
+    short_len = 0;
+    for (i = 0; i < t->num_tails; i++) {
+        if (TAIL_SHORT_SUFFIX == t->tails[i].suffix)
+            short_len += strlen ((const char *) t->tails[i].short_suffix) + 1;
+    }
+    if (t->arena_len + short_len > TRIE_INDEX_MAX)
+        return -1;
 
     if (!file_write_int32 (file, TAIL_SIGNATURE) ||
         !file_write_int32 (file, t->first_free)  ||
-        !file_write_int32 (file, t->num_tails))
+        !file_write_int32 (file, t->num_tails)   ||
+        !file_write_int32 (file, t->arena_len + short_len))
     {
         return -1;
     }
+    len = t->arena_len;
     for (i = 0; i < t->num_tails; i++) {
-        int16   length;
-
+        int32   suffix;
+
+        suffix = -1;
+        if (TAIL_SHORT_SUFFIX == t->tails[i].suffix) {
+            suffix = (int32) len;
+            len += strlen ((const char *) t->tails[i].short_suffix) + 1;
+        } else if (TAIL_NO_SUFFIX != t->tails[i].suffix) {
+            suffix = (int32) t->tails[i].suffix;
+        }
         if (!file_write_int32 (file, t->tails[i].next_free) ||
-            !file_write_int32 (file, t->tails[i].data))
+            !file_write_int32 (file, t->tails[i].data) ||
+            !file_write_int32 (file, suffix))
         {
             return -1;
         }
-
-        length = t->tails[i].suffix ? strlen ((const char *)t->tails[i].suffix)
-                                    : 0;
-        if (!file_write_int16 (file, length))
-            return -1;
-        if (length > 0 &&
-            !file_write_chars (file, (char *)t->tails[i].suffix, length))
+    }
+    if (t->arena_len > 0
+        && !file_write_chars (file, (const char *) t->arena, t->arena_len))
+    {
+        return -1;
+    }
+    for (i = 0; i < t->num_tails; i++) {
+        if (TAIL_SHORT_SUFFIX == t->tails[i].suffix
+            && !file_write_chars (file,
+                                  (const char *) t->tails[i].short_suffix,
+                                  strlen ((const char *)
+                                              t->tails[i].short_suffix) + 1))
         {
             return -1;
         }
@@ -177,27 +335,198 @@ const TrieChar *
 tail_get_suffix (const Tail *t, TrieIndex index)
 {
     index -= TAIL_START_BLOCKNO;
-    return (index < t->num_tails) ? t->tails[index].suffix : NULL;
+    if (index < 0 || index >= t->num_tails
+        || TAIL_NO_SUFFIX == t->tails[index].suffix)
+    {
+        return NULL;
+    }
+    if (TAIL_SHORT_SUFFIX == t->tails[index].suffix)
+        return t->tails[index].short_suffix;
+    return t->arena + t->tails[index].suffix;
 }
 
 Bool
 tail_set_suffix (Tail *t, TrieIndex index, const TrieChar *suffix)
 {
+    const TrieChar *old;
+    size_t          len, dst;
+
     index -= TAIL_START_BLOCKNO;
-    if (index < t->num_tails) {
-        /* suffix and t->tails[index].suffix may overlap;
-         * so, dup it before it's overwritten
-         */
-        TrieChar *tmp = NULL;
-        if (suffix)
-            tmp = (TrieChar *) strdup ((const char *)suffix);
-        if (t->tails[index].suffix)
-            free (t->tails[index].suffix);
-        t->tails[index].suffix = tmp;
+    if (index < 0 || index >= t->num_tails)
+        return FALSE;
 
+    if (!suffix) {
+        tail_drop_suffix (t, index);
         return TRUE;
     }
-    return FALSE;
+
+    /* a short suffix goes in the block, minding that it may be a tail of
+     * the current one
+     */
+    len = strlen ((const char *) suffix) + 1;
+    if (len <= TAIL_SHORT_SIZE) {
+        TrieChar    buf[TAIL_SHORT_SIZE];
+
+        memcpy (buf, suffix, len);
+        tail_drop_suffix (t, index);
+        memcpy (t->tails[index].short_suffix, buf, len);
+        t->tails[index].suffix = TAIL_SHORT_SUFFIX;
+        return TRUE;
+    }
+
+    /* a tail of the current suffix is just cut off in place */
+    old = tail_get_suffix (t, index + TAIL_START_BLOCKNO);
+    if (old && old <= suffix && suffix <= old + strlen ((const char *) old)) {
+        t->arena_garbage += suffix - old;
+        t->tails[index].suffix = suffix - t->arena;
+        return TRUE;
+    }
+
+    /* otherwise append a copy, minding that the arena may move while
+     * suffix points into it
+     */
+    dst = t->arena_len;
+    if (dst + len > t->arena_size) {
+        uintptr_t   p = (uintptr_t) suffix, a = (uintptr_t) t->arena;
+        size_t      new_size;
+        size_t      src = TAIL_NO_SUFFIX;
+
+        /* compared as integers, so no pointer is kept past the realloc */
+        if (t->arena && a <= p && p < a + t->arena_len)
+            src = p - a;
+        new_size = MAX_VAL (256, 2 * t->arena_size);
+        if (!tail_reserve_arena (t, MAX_VAL (new_size, dst + len)))
+            return FALSE;
+        if (TAIL_NO_SUFFIX != src)
+            suffix = t->arena + src;
+    }
+    memcpy (t->arena + dst, suffix, len);
+    t->arena_len += len;
+    tail_drop_suffix (t, index);
+    t->tails[index].suffix = dst;
+
+    return TRUE;
+}
+
+Bool
+tail_reserve (Tail *t, TrieIndex num_blocks, size_t suffix_bytes)
+{
+    if (num_blocks > t->alloc_tails) {
+        TailBlock  *tails;
+
+        tails = (TailBlock *) realloc (t->tails,
+                                       num_blocks * sizeof (TailBlock));
+        if (!tails)
+            return FALSE;
+        t->tails = tails;
+        t->alloc_tails = num_blocks;
+    }
+
+    return tail_reserve_arena (t, t->arena_len + suffix_bytes);
+}
+
+void
+tail_shrink (Tail *t)
+{
+    if (t->num_tails != t->alloc_tails) {
+        if (0 == t->num_tails) {
+            free (t->tails);
+            t->tails = NULL;
+            t->alloc_tails = 0;
+        } else {
+            TailBlock  *tails;
+
+            tails = (TailBlock *) realloc (t->tails,
+                                           t->num_tails * sizeof (TailBlock));
+            if (tails) {
+                t->tails = tails;
+                t->alloc_tails = t->num_tails;
+            }
+        }
+    }
+
+    if (t->arena_len != t->arena_size) {
+        if (0 == t->arena_len) {
+            free (t->arena);
+            t->arena = NULL;
+            t->arena_size = 0;
+        } else {
+            TrieChar   *arena;
+
+            arena = (TrieChar *) realloc (t->arena, t->arena_len);
+            if (arena) {
+                t->arena = arena;
+                t->arena_size = t->arena_len;
+            }
+        }
+    }
+}
+
+/* Sorting the suffixes by their reverse puts each suffix right before
+ * the ones it ends, if any. Walking that order backward then, a suffix
+ * that ends the last one written is pointed into it, and any other one is
+ * written anew.
+ */
+Bool
+tail_pack_suffixes (Tail *t)
+{
+    TailSuffixRef  *refs;
+    TrieChar       *arena;
+    size_t          len, owner, owner_len;
+    TrieIndex       i, n;
+
+    if (0 == t->arena_garbage && t->arena_shared == t->arena_len) {
+        tail_shrink (t);
+        return TRUE;
+    }
+
+    refs = (TailSuffixRef *) malloc (MAX_VAL (t->num_tails, 1)
+                                     * sizeof (TailSuffixRef));
+    if (!refs)
+        return FALSE;
+
+    len = 0;
+    for (i = n = 0; i < t->num_tails; i++) {
+        if (!tail_is_in_arena (t->tails[i].suffix))
+            continue;
+        refs[n].suffix = t->arena + t->tails[i].suffix;
+        refs[n].len = strlen ((const char *) refs[n].suffix);
+        refs[n].block = i;
+        len += refs[n++].len + 1;
+    }
+    qsort (refs, n, sizeof (TailSuffixRef), tail_suffix_ref_cmp);
+
+    arena = (TrieChar *) malloc (MAX_VAL (len, 1));
+    if (!arena) {
+        free (refs);
+        return FALSE;
+    }
+
+    len = owner = owner_len = 0;
+    for (i = n - 1; i >= 0; i--) {
+        const TailSuffixRef *r = &refs[i];
+
+        if (len > 0 && r->len <= owner_len
+            && 0 == memcmp (arena + owner + owner_len - r->len,
+                            r->suffix, r->len))
+        {
+            t->tails[r->block].suffix = owner + owner_len - r->len;
+            continue;
+        }
+        memcpy (arena + len, r->suffix, r->len + 1);
+        t->tails[r->block].suffix = owner = len;
+        owner_len = r->len;
+        len += r->len + 1;
+    }
+    free (refs);
+
+    free (t->arena);
+    t->arena = arena;
+    t->arena_len = t->arena_size = t->arena_shared = len;
+    t->arena_garbage = 0;
+    tail_shrink (t);
+
+    return TRUE;
 }
 
 TrieIndex
@@ -206,27 +535,72 @@ tail_add_suffix (Tail *t, const TrieChar *suffix)
     TrieIndex   new_block;
 
     new_block = tail_alloc_block (t);
-    tail_set_suffix (t, new_block, suffix);
+    if (TRIE_INDEX_ERROR == new_block)
+        return TRIE_INDEX_ERROR;
+    if (!tail_set_suffix (t, new_block, suffix)) {
+        tail_free_block (t, new_block);
+        return TRIE_INDEX_ERROR;
+    }
 
     return new_block;
 }
 
+static Bool
+tail_reserve_arena (Tail *t, size_t arena_size)
+{
+    TrieChar   *arena;
+
+    if (arena_size <= t->arena_size)
+        return TRUE;
+
+    arena = (TrieChar *) realloc (t->arena, arena_size);
+    if (!arena)
+        return FALSE;
+    t->arena = arena;
+    t->arena_size = arena_size;
+
+    return TRUE;
+}
+
+/* give up the space of a block's suffix, reclaiming it at once if it is
+ * the last one in the arena
+ */
+static void
+tail_drop_suffix (Tail *t, TrieIndex block)
+{
+    size_t  off, len;
+
+    off = t->tails[block].suffix;
+    t->tails[block].suffix = TAIL_NO_SUFFIX;
+    if (!tail_is_in_arena (off))
+        return;
+
+    len = strlen ((const char *) t->arena + off) + 1;
+    if (off + len == t->arena_len && off >= t->arena_shared)
+        t->arena_len = off;
+    else
+        t->arena_garbage += len;
+}
+
 static TrieIndex
 tail_alloc_block (Tail *t)
 {
     TrieIndex   block;
 
-    if (0 != t->first_free) {
+    if (TAIL_FREE_END != t->first_free) {
         block = t->first_free;
         t->first_free = t->tails[block].next_free;
     } else {
-        block = t->num_tails;
-        t->tails = (TailBlock *) realloc (t->tails,
-                                          ++t->num_tails * sizeof (TailBlock));
+        if (t->num_tails == t->alloc_tails
+            && !tail_reserve (t, MAX_VAL (16, 2 * t->alloc_tails), 0))
+        {
+            return TRIE_INDEX_ERROR;
+        }
+        block = t->num_tails++;
     }
-    t->tails[block].next_free = -1;
+    t->tails[block].next_free = TAIL_USED;
     t->tails[block].data = TRIE_DATA_ERROR;
-    t->tails[block].suffix = NULL;
+    t->tails[block].suffix = TAIL_NO_SUFFIX;
     
     return block + TAIL_START_BLOCKNO;
 }
@@ -234,30 +608,55 @@ tail_alloc_block (Tail *t)
 static void
 tail_free_block (Tail *t, TrieIndex block)
 {
-    TrieIndex   i, j;
-
     block -= TAIL_START_BLOCKNO;
 
-    if (block >= t->num_tails)
+    if (block < 0 || block >= t->num_tails
+        || TAIL_USED != t->tails[block].next_free)
+    {
         return;
+    }
 
     t->tails[block].data = TRIE_DATA_ERROR;
-    if (NULL != t->tails[block].suffix) {
-        free (t->tails[block].suffix);
-        t->tails[block].suffix = NULL;
+    tail_drop_suffix (t, block);
+
+    t->tails[block].next_free = t->first_free;
+    t->first_free = block;
+}
+
+/* move short suffixes read into the arena to their blocks */
+static void
+tail_shorten_suffixes (Tail *t)
+{
+    TrieIndex   i;
+
+    for (i = 0; i < t->num_tails; i++) {
+        size_t  off = t->tails[i].suffix;
+        size_t  len;
+
+        if (!tail_is_in_arena (off))
+            continue;
+        len = strlen ((const char *) t->arena + off) + 1;
+        if (len <= TAIL_SHORT_SIZE) {
+            memcpy (t->tails[i].short_suffix, t->arena + off, len);
+            t->tails[i].suffix = TAIL_SHORT_SUFFIX;
+            t->arena_garbage += len;
+        }
     }
+}
 
-    /* find insertion point */
-    j = 0;
-    for (i = t->first_free; i != 0 && i < block; i = t->tails[i].next_free)
-        j = i;
+/* stack the free blocks so that the lowest is reused first */
+static void
+tail_link_free_blocks (Tail *t)
+{
+    TrieIndex   i;
 
-    /* insert free block between j and i */
-    t->tails[block].next_free = i;
-    if (0 != j)
-        t->tails[j].next_free = block;
-    else
-        t->first_free = block;
+    t->first_free = TAIL_FREE_END;
+    for (i = t->num_tails - 1; i >= 0; i--) {
+        if (TAIL_USED != t->tails[i].next_free) {
+            t->tails[i].next_free = t->first_free;
+            t->first_free = i;
+        }
+    }
 }
 
 TrieData
@@ -267,6 +666,24 @@ tail_get_data (const Tail *t, TrieIndex index)
     return (index < t->num_tails) ? t->tails[index].data : TRIE_DATA_ERROR;
 }
 
+TrieData *
+tail_get_data_ptr (Tail *t, TrieIndex index)
+{
+    index -= TAIL_START_BLOCKNO;
+    return (index >= 0 && index < t->num_tails) ? &t->tails[index].data
+                                                : NULL;
+}
+
+void
+tail_prefetch (const Tail *t, TrieIndex index)
+{
+#if defined(__GNUC__)
+    index -= TAIL_START_BLOCKNO;
+    if (index >= 0 && index < t->num_tails)
+        __builtin_prefetch (&t->tails[index]);
+#endif
+}
+
 Bool
 tail_set_data (Tail *t, TrieIndex index, TrieData data)
 {
@@ -284,16 +701,16 @@ tail_delete (Tail *t, TrieIndex index)
     tail_free_block (t, index);
 }
 
-int
+size_t
 tail_walk_str  (const Tail      *t,
                 TrieIndex        s,
-                short           *suffix_idx,
+                int             *suffix_idx,
                 const TrieChar  *str,
-                int              len)
+                size_t           len)
 {
     const TrieChar *suffix;
-    int             i;
-    short           j;
+    size_t          i;
+    int             j;
 
     suffix = tail_get_suffix (t, s);
     if (!suffix)
@@ -316,7 +733,7 @@ tail_walk_str  (const Tail      *t,
 Bool
 tail_walk_char (const Tail      *t,
                 TrieIndex        s,
-                short           *suffix_idx,
+                int             *suffix_idx,
                 TrieChar         c)
 {
     const TrieChar *suffix;
@@ -335,6 +752,23 @@ tail_walk_char (const Tail      *t,
     return FALSE;
 }
 
+static int
+tail_suffix_ref_cmp (const void *a, const void *b)
+{
+    const TailSuffixRef *x = (const TailSuffixRef *) a;
+    const TailSuffixRef *y = (const TailSuffixRef *) b;
+    size_t               i, j;
+
+    for (i = x->len, j = y->len; i > 0 && j > 0; ) {
+        TrieChar cx = x->suffix[--i];
+        TrieChar cy = y->suffix[--j];
+
+        if (cx != cy)
+            return (cx < cy) ? -1 : 1;
+    }
+    return (i > 0) - (j > 0);
+}
+
 /*
 vi:ts=4:ai:expandtab
 */
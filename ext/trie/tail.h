@@ -40,6 +40,19 @@ Tail *   tail_new ();
  */
 Tail *   tail_read (FILE *file);
 
+/**
+ * @brief Check for unescaped keys
+ *
+ * @param t : the tail data
+ *
+ * @return TRUE if the tail data was read from a file written before keys
+ *         were escaped, FALSE otherwise
+ *
+ * Such files hold the key bytes 0x01 as they are, which tries without an
+ * alphabet map now take for an escape.
+ */
+Bool     tail_has_raw_keys (const Tail *t);
+
 /**
  * @brief Free tail data
  *
@@ -65,16 +78,59 @@ void     tail_free (Tail *t);
 int      tail_write (const Tail *t, FILE *file);
 
 
+/**
+ * @brief Reserve space in tail data
+ *
+ * @param t            : the tail data
+ * @param num_blocks   : the number of suffix entries to make room for
+ * @param suffix_bytes : the number of suffix bytes to add room for,
+ *                       terminators included
+ *
+ * @return boolean indicating success
+ *
+ * Pre-allocate room for @a num_blocks suffix entries, and for
+ * @a suffix_bytes more bytes of suffixes, so that adding up to that much
+ * does not reallocate.
+ */
+Bool     tail_reserve (Tail *t, TrieIndex num_blocks, size_t suffix_bytes);
+
+/**
+ * @brief Release unused space in tail data
+ *
+ * @param t : the tail data
+ *
+ * Give back the room reserved past the last suffix entry and the last
+ * suffix byte.
+ */
+void     tail_shrink (Tail *t);
+
+/**
+ * @brief Pack suffixes in tail data
+ *
+ * @param t : the tail data
+ *
+ * @return boolean indicating success
+ *
+ * Suffixes are stored back to back in one buffer, where the space of
+ * deleted or shortened suffixes is left unused until this function moves
+ * the live suffixes together. A suffix that ends another one is made to
+ * share its bytes, so keys with common endings are stored once. Spare
+ * capacity is released as with tail_shrink(). Pointers to suffixes are
+ * invalidated.
+ */
+Bool     tail_pack_suffixes (Tail *t);
+
+
 /**
  * @brief Get suffix
  *
  * @param t     : the tail data
  * @param index : the index of the suffix
  *
- * @return an allocated string of the indexed suffix.
+ * @return the indexed suffix, NULL if there is none
  *
- * Get suffix from tail with given @a index. The returned string is allocated.
- * The caller should free it with free().
+ * Get suffix from tail with given @a index. The returned string belongs to
+ * the tail data, and is only valid until the tail data is next changed.
  */
 const TrieChar *    tail_get_suffix (const Tail *t, TrieIndex index);
 
@@ -85,7 +141,8 @@ const TrieChar *    tail_get_suffix (const Tail *t, TrieIndex index);
  * @param index  : the index of the suffix
  * @param suffix : the new suffix
  *
- * Set suffix of existing entry of given @a index in tail.
+ * Set suffix of existing entry of given @a index in tail. A @a suffix
+ * pointing into the current suffix of the entry shortens it in place.
  */
 Bool     tail_set_suffix (Tail *t, TrieIndex index, const TrieChar *suffix);
 
@@ -113,6 +170,28 @@ TrieIndex tail_add_suffix (Tail *t, const TrieChar *suffix);
  */
 TrieData tail_get_data (const Tail *t, TrieIndex index);
 
+/**
+ * @brief Get the location of data associated to suffix entry
+ *
+ * @param t      : the tail data
+ * @param index  : the index of the suffix
+ *
+ * @return pointer to the data of the suffix entry, NULL on invalid index
+ *
+ * The pointer stays valid only until a suffix entry is next added to @a t.
+ */
+TrieData * tail_get_data_ptr (Tail *t, TrieIndex index);
+
+/**
+ * @brief Prefetch a suffix entry
+ *
+ * @param t      : the tail data
+ * @param index  : the index of the suffix
+ *
+ * Hint that entry @a index is about to be read.
+ */
+void     tail_prefetch (const Tail *t, TrieIndex index);
+
 /**
  * @brief Set data associated to suffix entry
  *
@@ -152,11 +231,11 @@ void     tail_delete (Tail *t, TrieIndex index);
  * @a *suffix_idx is updated to the position after the last successful walk,
  * and the function returns the total number of character succesfully walked.
  */
-int      tail_walk_str  (const Tail      *t,
+size_t   tail_walk_str  (const Tail      *t,
                          TrieIndex        s,
-                         short           *suffix_idx,
+                         int             *suffix_idx,
                          const TrieChar  *str,
-                         int              len);
+                         size_t           len);
 
 /**
  * @brief Walk in tail with a character
@@ -175,7 +254,7 @@ int      tail_walk_str  (const Tail      *t,
  */
 Bool     tail_walk_char (const Tail      *t,
                          TrieIndex        s,
-                         short           *suffix_idx,
+                         int             *suffix_idx,
                          TrieChar         c);
 
 /**
@@ -194,7 +273,7 @@ Bool     tail_walk_char (const Tail      *t,
 /*
 Bool     tail_is_walkable_char (Tail            *t,
                                 TrieIndex        s,
-                                short            suffix_idx,
+                                int              suffix_idx,
                                 const TrieChar   c);
 */
 #define  tail_is_walkable_char(t,s,suffix_idx,c) \
@@ -4,39 +4,499 @@
 #include "darray.h"
 #include "tail.h"
 #include "trie.h"
+#include "trie-private.h"
 
 Trie* trie_new() {
 	Trie *trie = (Trie*) malloc(sizeof(Trie));
+	trie->alpha_map = NULL;
+	trie->num_walks = 0;
+	trie->weigh = NULL;
 	trie->da = da_new();
 	trie->tail = tail_new();
 	return trie;
 }
 
 void trie_free(Trie *trie) {
+	if (trie->alpha_map)
+		alpha_map_free(trie->alpha_map);
 	da_free(trie->da);
 	tail_free(trie->tail);
 	free(trie);
 }
 
-static Bool trie_branch_in_branch (Trie *trie, TrieIndex sep_node, const TrieChar *suffix, TrieData data) {
+/* Keys and walks are translated through the map from then on, so it may
+ * only be set while the trie is empty. The trie takes ownership of it.
+ */
+void trie_set_alpha_map (Trie *trie, AlphaMap *alpha_map) {
+    if (trie->alpha_map)
+        alpha_map_free (trie->alpha_map);
+    trie->alpha_map = alpha_map;
+}
+
+#define TRIE_KEY_BUF_SIZE 256
+#define TRIE_CHAR_ESCAPE  0x01
+
+/* Without an alphabet map, the key bytes 0x00 and 0x01 are stored as
+ * 0x01 0x01 and 0x01 0x02, which keeps TRIE_CHAR_TERM out of the codes and
+ * the codes in the same order as the keys. Other keys are their own codes.
+ */
+#define trie_char_is_escaped(c)  ((c) <= TRIE_CHAR_ESCAPE)
+
+static Bool trie_key_is_plain (const Trie *trie, const TrieChar *key, size_t len) {
+    size_t  i;
+
+    if (trie->alpha_map)
+        return FALSE;
+    for (i = 0; i < len; i++) {
+        if (trie_char_is_escaped (key[i]))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* Translate a key of len bytes into null-terminated trie codes, into buf
+ * if given and they fit or else into newly allocated memory, and set
+ * *o_len to their number. Returns NULL if the key has characters outside
+ * the alphabet, or on failure.
+ */
+static TrieChar * trie_map_key (const AlphaMap *alpha_map, const TrieChar *key, size_t len, TrieChar *buf, size_t *o_len) {
+    TrieChar   *codes;
+    size_t      size, i, n;
+
+    size = len + 1;
+    if (!alpha_map) {
+        for (i = 0; i < len; i++) {
+            if (trie_char_is_escaped (key[i]))
+                ++size;
+        }
+    }
+    codes = (buf && size <= TRIE_KEY_BUF_SIZE) ? buf
+                                               : (TrieChar *) malloc (size);
+    if (!codes)
+        return NULL;
+
+    for (i = n = 0; i < len; i++) {
+        if (alpha_map) {
+            int tc = alpha_map_char_to_trie (alpha_map, key[i]);
+
+            if (tc <= 0) {
+                if (codes != buf)
+                    free (codes);
+                return NULL;
+            }
+            codes[n++] = (TrieChar) tc;
+        } else if (trie_char_is_escaped (key[i])) {
+            codes[n++] = TRIE_CHAR_ESCAPE;
+            codes[n++] = key[i] + 1;
+        } else {
+            codes[n++] = key[i];
+        }
+    }
+    codes[n] = TRIE_CHAR_TERM;
+
+    *o_len = n;
+    return codes;
+}
+
+/* Escape a key for a trie without an alphabet map, as for trie_build().
+ * The result is null-terminated and is to be freed by the caller.
+ */
+TrieChar * trie_escape_key (const TrieChar *key, size_t len, size_t *o_len) {
+    return trie_map_key (NULL, key, len, NULL, o_len);
+}
+
+/* Undo the escaping of trie_escape_key() in place, returning the length of
+ * the key.
+ */
+size_t trie_unescape_key (TrieChar *key, size_t len) {
+    size_t  i, n;
+
+    for (i = n = 0; i < len; i++, n++) {
+        if (TRIE_CHAR_ESCAPE == key[i] && i + 1 < len)
+            key[n] = key[++i] - 1;
+        else
+            key[n] = key[i];
+    }
+    return n;
+}
+
+Bool trie_reserve (Trie *trie, TrieIndex num_keys, size_t avg_key_len) {
+    /* a key takes one separate node plus a share of the branch nodes
+     * above it, usually well under two cells; at least its first byte is
+     * in the branches, which leaves room for the suffix terminator */
+    return da_reserve (trie->da, 2 * num_keys)
+           && tail_reserve (trie->tail, num_keys, num_keys * avg_key_len);
+}
+
+/* With weights kept, each state weighs as much as the heaviest key below
+ * it, and a separate node as much as its key. Cells not in use weigh
+ * TRIE_WEIGHT_NONE, which the double array sees to.
+ */
+static int64_t trie_weigh_state (const Trie *trie, TrieIndex s) {
+    const DArray   *da = trie->da;
+    TrieIndex       base;
+    int64_t         w;
+    int             c;
+
+    base = da_get_base (da, s);
+    if (base < 0)
+        return (*trie->weigh) (tail_get_data (trie->tail, -base));
+
+    w = TRIE_WEIGHT_NONE;
+    for (c = da_first_child (da, s); c >= 0; c = da_next_child (da, s, c))
+        w = MAX_VAL (w, da_get_weight (da, base + c));
+    return w;
+}
+
+/* Bring the weights of s and its ancestors up to date after the data or
+ * the children of s changed. A state whose weight stays the same leaves
+ * those above it as they are, and the children of a parent are only
+ * weighed again when its heaviest child got lighter.
+ */
+static void trie_reweigh (Trie *trie, TrieIndex s) {
+    DArray     *da = trie->da;
+    TrieIndex   root;
+    int64_t     w, old, p_old;
+
+    if (!trie->weigh)
+        return;
+
+    root = da_get_root (da);
+    w = trie_weigh_state (trie, s);
+    for (;;) {
+        old = da_get_weight (da, s);
+        if (w == old)
+            return;
+        da_set_weight (da, s, w);
+        if (root == s)
+            return;
+
+        s = da_get_check (da, s);
+        p_old = da_get_weight (da, s);
+        if (w < p_old) {
+            if (old < p_old)
+                return;
+            w = trie_weigh_state (trie, s);
+        }
+    }
+}
+
+/* Weigh every state, children before their parents. */
+static Bool trie_weigh_all (Trie *trie) {
+    DArray     *da = trie->da;
+    TrieIndex  *order, s, base;
+    size_t      head, tail;
+    int         c;
+
+    if (!da_keep_weights (da))
+        return FALSE;
+    order = (TrieIndex *) malloc (da_get_num_cells (da) * sizeof (TrieIndex));
+    if (!order)
+        return FALSE;
+
+    /* breadth first, so that children come after their parents */
+    head = tail = 0;
+    order[tail++] = da_get_root (da);
+    while (head < tail) {
+        s = order[head++];
+        base = da_get_base (da, s);
+        for (c = da_first_child (da, s); c >= 0; c = da_next_child (da, s, c))
+            order[tail++] = base + c;
+    }
+    while (tail > 0) {
+        s = order[--tail];
+        da_set_weight (da, s, trie_weigh_state (trie, s));
+    }
+
+    free (order);
+    return TRUE;
+}
+
+typedef struct {
+    const Tail *from;
+    Tail       *to;
+} TailCopy;
+
+static TrieIndex trie_copy_tail (TrieIndex tail_index, void *user_data) {
+    TailCopy  *copy = (TailCopy *) user_data;
+    TrieIndex  t;
+
+    t = tail_add_suffix (copy->to, tail_get_suffix (copy->from, tail_index));
+    if (TRIE_INDEX_ERROR != t)
+        tail_set_data (copy->to, t, tail_get_data (copy->from, tail_index));
+    return t;
+}
+
+/* Rebuild the double array breadth-first and the tail in the same order,
+ * dropping the free cells and blocks left behind by deletions.
+ */
+Bool trie_compact (Trie *trie) {
+    DArray   *da;
+    TailCopy  copy;
+
+    copy.from = trie->tail;
+    copy.to = tail_new ();
+    if (!copy.to)
+        return FALSE;
+
+    da = da_compact (trie->da, trie_copy_tail, &copy);
+    if (!da) {
+        tail_free (copy.to);
+        return FALSE;
+    }
+    tail_pack_suffixes (copy.to);
+
+    da_free (trie->da);
+    tail_free (trie->tail);
+    trie->da = da;
+    trie->tail = copy.to;
+
+    /* the weights are not carried over; drop them if they can not be
+     * made again */
+    if (trie->weigh && !trie_weigh_all (trie))
+        trie->weigh = NULL;
+    return TRUE;
+}
+
+typedef struct {
+    TrieIndex   state;
+    TrieIndex   lo, hi;     /**< range of keys below the state */
+    int         depth;      /**< length of the prefix the keys share */
+} BuildFrame;
+
+/* Build a trie from keys sorted in ascending byte order with no
+ * duplicates, given as codes, such as from trie_escape_key(). As all keys
+ * sharing a prefix are adjacent, each node's whole set of child labels is
+ * known before it is placed, so each node gets its base in a single search
+ * and nothing is ever relocated.
+ */
+Trie * trie_build (const TrieChar *keys[], const TrieData data[], TrieIndex num_keys) {
+    Trie       *trie;
+    BuildFrame *stack = NULL;
+    int         top, stack_size;
+    size_t      key_bytes;
+    TrieIndex   i;
+
+    trie = trie_new ();
+    if (!trie)
+        return NULL;
+    if (0 == num_keys)
+        return trie;
+
+    key_bytes = 0;
+    for (i = 0; i < num_keys; i++)
+        key_bytes += strlen ((const char *) keys[i]) + 1;
+    if (!trie_reserve (trie, num_keys, key_bytes / num_keys + 1))
+        goto fail;
+
+    stack_size = 64;
+    stack = (BuildFrame *) malloc (stack_size * sizeof (BuildFrame));
+    if (!stack)
+        goto fail;
+
+    top = 0;
+    stack[top].state = da_get_root (trie->da);
+    stack[top].lo = 0;
+    stack[top].hi = num_keys;
+    stack[top].depth = 0;
+    top++;
+
+    while (top > 0) {
+        BuildFrame  f = stack[--top];
+        TrieChar    chars[256];
+        TrieIndex   ends[256];
+        TrieIndex   base, j;
+        int         n, k;
+
+        /* keys sharing the label at this depth are adjacent */
+        n = 0;
+        for (i = f.lo; i < f.hi; i = j) {
+            TrieChar c = keys[i][f.depth];
+
+            for (j = i + 1; j < f.hi && keys[j][f.depth] == c; j++)
+                ;
+            if (TRIE_CHAR_TERM == c && j - i > 1)
+                goto fail;      /* duplicated key */
+            chars[n] = c;
+            ends[n++] = j;
+        }
+
+        base = da_insert_branches (trie->da, f.state, chars, n);
+        if (TRIE_INDEX_ERROR == base)
+            goto fail;
+
+        /* push in reverse so that children are visited in order */
+        if (top + n > stack_size) {
+            BuildFrame *new_stack;
+
+            stack_size = 2 * (top + n);
+            new_stack = (BuildFrame *) realloc (stack, stack_size * sizeof (BuildFrame));
+            if (!new_stack)
+                goto fail;
+            stack = new_stack;
+        }
+        for (k = n - 1; k >= 0; k--) {
+            TrieIndex next = base + chars[k];
+
+            i = (k > 0) ? ends[k - 1] : f.lo;
+            if (ends[k] - i == 1) {
+                const TrieChar *suffix = keys[i] + f.depth;
+                TrieIndex       t;
+
+                if ('\0' != *suffix)
+                    ++suffix;
+                t = tail_add_suffix (trie->tail, suffix);
+                if (TRIE_INDEX_ERROR == t)
+                    goto fail;
+                tail_set_data (trie->tail, t, data[i]);
+                trie_da_set_tail_index (trie->da, next, t);
+            } else {
+                stack[top].state = next;
+                stack[top].lo = i;
+                stack[top].hi = ends[k];
+                stack[top].depth = f.depth + 1;
+                top++;
+            }
+        }
+    }
+
+    free (stack);
+    tail_pack_suffixes (trie->tail);
+    return trie;
+
+fail:
+    free (stack);
+    trie_free (trie);
+    return NULL;
+}
+
+typedef struct {
+    const Trie *trie;
+    TrieChar  **keys;
+    TrieData   *data;
+    TrieIndex   num_keys, alloc_keys;
+    Bool        escaped;    /**< whether any key needed escaping */
+} RawKeys;
+
+static Bool trie_collect_raw_key (const TrieChar *key, TrieIndex sep_node, void *user_data) {
+    RawKeys        *raw = (RawKeys *) user_data;
+    const Trie     *trie = raw->trie;
+    const TrieChar *suffix;
+    TrieChar       *full, *codes;
+    TrieIndex       t;
+    size_t          key_len, suffix_len, len;
+
+    if (raw->num_keys == raw->alloc_keys) {
+        TrieIndex   n = MAX_VAL (64, 2 * raw->alloc_keys);
+        TrieChar  **keys;
+        TrieData   *data;
+
+        keys = (TrieChar **) realloc (raw->keys, n * sizeof (TrieChar *));
+        if (!keys)
+            return FALSE;
+        raw->keys = keys;
+        data = (TrieData *) realloc (raw->data, n * sizeof (TrieData));
+        if (!data)
+            return FALSE;
+        raw->data = data;
+        raw->alloc_keys = n;
+    }
+
+    /* the key ends either in the branches or with its suffix */
+    t = trie_da_get_tail_index (trie->da, sep_node);
+    suffix = tail_get_suffix (trie->tail, t);
+    if (!suffix)
+        suffix = (const TrieChar *) "";
+    key_len = strlen ((const char *) key);
+    suffix_len = strlen ((const char *) suffix);
+    full = (TrieChar *) malloc (key_len + suffix_len + 1);
+    if (!full)
+        return FALSE;
+    memcpy (full, key, key_len);
+    memcpy (full + key_len, suffix, suffix_len + 1);
+
+    codes = trie_escape_key (full, key_len + suffix_len, &len);
+    free (full);
+    if (!codes)
+        return FALSE;
+    if (len != key_len + suffix_len)
+        raw->escaped = TRUE;
+
+    raw->keys[raw->num_keys] = codes;
+    raw->data[raw->num_keys++] = tail_get_data (trie->tail, t);
+    return TRUE;
+}
+
+/* Files written before keys were escaped hold the byte 0x01 as it is,
+ * where a trie without an alphabet map now reads an escape. Rebuild such
+ * a trie from its keys escaped. The enumeration goes in byte order, which
+ * escaping keeps, as trie_build() needs.
+ */
+Bool trie_escape_raw_keys (Trie *trie) {
+    RawKeys     raw;
+    Trie       *built = NULL;
+    DArray     *da;
+    Tail       *tail;
+    TrieIndex   i;
+    Bool        ok;
+
+    if (trie->alpha_map || !tail_has_raw_keys (trie->tail))
+        return TRUE;
+
+    raw.trie = trie;
+    raw.keys = NULL;
+    raw.data = NULL;
+    raw.num_keys = raw.alloc_keys = 0;
+    raw.escaped = FALSE;
+
+    ok = da_enumerate (trie->da, trie_collect_raw_key, &raw);
+    if (ok && raw.escaped) {
+        built = trie_build ((const TrieChar **) raw.keys, raw.data, raw.num_keys);
+        ok = (NULL != built);
+    }
+    if (built) {
+        da = trie->da;
+        tail = trie->tail;
+        trie->da = built->da;
+        trie->tail = built->tail;
+        built->da = da;
+        built->tail = tail;
+        trie_free (built);
+    }
+
+    for (i = 0; i < raw.num_keys; i++)
+        free (raw.keys[i]);
+    free (raw.keys);
+    free (raw.data);
+    return ok;
+}
+
+/* The branching functions return the separate node of the new key, or
+ * TRIE_INDEX_ERROR on failure.
+ */
+static TrieIndex trie_branch_in_branch (Trie *trie, TrieIndex sep_node, const TrieChar *suffix, TrieData data) {
     TrieIndex new_da, new_tail;
 
     new_da = da_insert_branch (trie->da, sep_node, *suffix);
     if (TRIE_INDEX_ERROR == new_da)
-        return FALSE;
+        return TRIE_INDEX_ERROR;
 
     if ('\0' != *suffix)
         ++suffix;
 
     new_tail = tail_add_suffix (trie->tail, suffix);
+    if (TRIE_INDEX_ERROR == new_tail) {
+        da_prune_upto (trie->da, sep_node, new_da);
+        return TRIE_INDEX_ERROR;
+    }
     tail_set_data (trie->tail, new_tail, data);
     trie_da_set_tail_index (trie->da, new_da, new_tail);
 
     // trie->is_dirty = TRUE;
-    return TRUE;
+    return new_da;
 }
 
-static Bool trie_branch_in_tail(Trie *trie, TrieIndex sep_node, const TrieChar *suffix, TrieData data) {
+static TrieIndex trie_branch_in_tail(Trie *trie, TrieIndex sep_node, const TrieChar *suffix, TrieData data) {
     TrieIndex old_tail, old_da, s;
     const TrieChar *old_suffix, *p;
 
@@ -44,7 +504,7 @@ static Bool trie_branch_in_tail(Trie *trie, TrieIndex sep_node, const TrieChar *
     old_tail = trie_da_get_tail_index (trie->da, sep_node);
     old_suffix = tail_get_suffix (trie->tail, old_tail);
     if (!old_suffix)
-        return FALSE;
+        return TRIE_INDEX_ERROR;
 
     for (p = old_suffix, s = sep_node; *p == *suffix; p++, suffix++) {
         TrieIndex t = da_insert_branch (trie->da, s, *p);
@@ -61,6 +521,7 @@ static Bool trie_branch_in_tail(Trie *trie, TrieIndex sep_node, const TrieChar *
         ++p;
     tail_set_suffix (trie->tail, old_tail, p);
     trie_da_set_tail_index (trie->da, old_da, old_tail);
+    trie_reweigh (trie, old_da);
 
     /* insert the new branch at the new separate point */
     return trie_branch_in_branch (trie, s, suffix, data);
@@ -69,192 +530,1692 @@ fail:
     /* failed, undo previous insertions and return error */
     da_prune_upto (trie->da, sep_node, s);
     trie_da_set_tail_index (trie->da, sep_node, old_tail);
-    return FALSE;
+    return TRIE_INDEX_ERROR;
 }
 
-Bool trie_store (Trie *trie, const TrieChar *key, TrieData data) {
+/* The branch states of the last key stored through it, for the next key
+ * to start its walk from where the two keys part. Inserting a key only
+ * ever relocates nodes off the path to its branching state, so the states
+ * the keys share stay valid.
+ */
+typedef struct {
+    TrieIndex      *states;     /**< states[i] is reached by i codes of key */
+    size_t          num_states;
+    size_t          alloc_states;
+    TrieChar       *key;
+    size_t          key_len;
+    size_t          alloc_key;
+} TriePath;
+
+/* Walk from the deepest saved state whose codes the key shares, and make
+ * the path the key's own from there. Returns the state to walk on from,
+ * with *o_depth set to the number of codes already walked.
+ */
+static TrieIndex trie_path_start (TriePath *path, const TrieChar *key, size_t key_len, size_t *o_depth) {
+    size_t  depth, max;
+
+    max = MIN_VAL (path->num_states - 1, MIN_VAL (path->key_len, key_len));
+    for (depth = 0; depth < max && path->key[depth] == key[depth]; depth++)
+        ;
+    path->num_states = depth + 1;
+
+    *o_depth = depth;
+    return path->states[depth];
+}
+
+static void trie_path_push (TriePath *path, TrieIndex s) {
+    if (path->num_states == path->alloc_states) {
+        size_t      new_size = 2 * path->alloc_states;
+        TrieIndex  *states;
+
+        states = (TrieIndex *) realloc (path->states,
+                                        new_size * sizeof (TrieIndex));
+        if (!states)
+            return;
+        path->states = states;
+        path->alloc_states = new_size;
+    }
+    path->states[path->num_states++] = s;
+}
+
+/* Find the separate node of a key, inserting the key with data if it is
+ * not there yet, as told by *o_stored. Returns TRIE_INDEX_ERROR on failure.
+ * With a path, the walk starts from it, and saves its states in it.
+ */
+static TrieIndex trie_insert_codes (Trie *trie, const TrieChar *key, size_t key_len, TrieData data, Bool *o_stored, TriePath *path) {
     TrieIndex        s, t;
-    short            suffix_idx;
-    const TrieChar *p, *sep;
-	size_t len;
+    int              suffix_idx;
+    const TrieChar  *p;
+    size_t           len, depth;
 
     /* walk through branches */
-    s = da_get_root (trie->da);
-    for (p = key; !trie_da_is_separate (trie->da, s); p++) {
+    *o_stored = TRUE;
+    depth = 0;
+    s = path ? trie_path_start (path, key, key_len, &depth)
+             : da_get_root (trie->da);
+    for (p = key + depth; !trie_da_is_separate (trie->da, s); p++) {
         if (!da_walk (trie->da, &s, *p))
             return trie_branch_in_branch (trie, s, p, data);
         if (0 == *p)
             break;
+        /* the path must stay a prefix of the key */
+        if (path && path->num_states == (size_t) (p - key) + 1
+            && !trie_da_is_separate (trie->da, s))
+        {
+            trie_path_push (path, s);
+        }
     }
 
     /* walk through tail */
-    sep = p;
     t = trie_da_get_tail_index (trie->da, s);
     suffix_idx = 0;
-    len = strlen ((const char *) p) + 1;    /* including null-terminator */
+    len = key_len - (p - key) + 1;          /* including null-terminator */
     if (tail_walk_str (trie->tail, t, &suffix_idx, p, len) != len)
         return trie_branch_in_tail (trie, s, p, data);
 
-    /* duplicated key, overwrite val */
-    tail_set_data (trie->tail, t, data);
-    // trie->is_dirty = TRUE;
-    return TRUE;
+    *o_stored = FALSE;
+    return s;
 }
 
 
-Bool trie_has_key (const Trie *trie, const TrieChar *key) {
-    TrieIndex        s;
-    short            suffix_idx;
-    const TrieChar *p;
-
-    /* walk through branches */
-    s = da_get_root (trie->da);
-    for (p = key; !trie_da_is_separate (trie->da, s); p++) {
-        if (!da_walk (trie->da, &s, *p))
-            return FALSE;
-        if (0 == *p)
-            break;
-    }
+/* Walk the branches from the root along the key up to end, indexing the
+ * cells directly: the cell tried from a non-separate state is always
+ * within the sentinel padding of the pool. Returns the separate node
+ * reached, with *key left at the rest of the key for the tail, or
+ * TRIE_INDEX_ERROR.
+ */
+static TrieIndex trie_walk_branches (const DArray *da, const TrieChar **key, const TrieChar *end) {
+    const TrieChar *p = *key;
+    TrieIndex       s, base, next;
+    TrieChar        c;
 
-    /* walk through tail */
-    s = trie_da_get_tail_index (trie->da, s);
-    suffix_idx = 0;
-    for ( ; ; p++) {
-        if (!tail_walk_char (trie->tail, s, &suffix_idx, *p))
-            return FALSE;
-        if (0 == *p)
+    s = da_get_root (da);
+    while ((base = da_fast_get_base (da, s)) >= 0) {
+        c = (p < end) ? *p : TRIE_CHAR_TERM;
+        next = base + c;
+        if (da_fast_get_check (da, next) != s)
+            return TRIE_INDEX_ERROR;
+        s = next;
+        if (TRIE_CHAR_TERM == c)
             break;
+        ++p;
     }
 
-    return TRUE;
+    *key = p;
+    return s;
 }
 
-
-Bool trie_retrieve (const Trie *trie, const TrieChar *key, TrieData *o_data) {
-    TrieIndex        s;
-    short            suffix_idx;
-    const TrieChar *p;
+/* Look up the tail block of a key of len codes, or TRIE_INDEX_ERROR. The
+ * rest of the key must match the suffix in full; as the codes hold no
+ * TRIE_CHAR_TERM, a shorter suffix stops the comparison at its end.
+ */
+static TrieIndex trie_find_tail (const Trie *trie, const TrieChar *key, size_t len, TrieIndex *o_sep) {
+    TrieIndex        s, t;
+    const TrieChar  *p, *suffix;
+    size_t           rest;
 
     /* walk through branches */
-    s = da_get_root (trie->da);
-    for (p = key; !trie_da_is_separate (trie->da, s); p++) {
-        if (!da_walk (trie->da, &s, *p))
-            return FALSE;
-        if (0 == *p)
-            break;
-    }
+    p = key;
+    s = trie_walk_branches (trie->da, &p, key + len);
+    if (TRIE_INDEX_ERROR == s)
+        return TRIE_INDEX_ERROR;
 
-    /* walk through tail */
-    s = trie_da_get_tail_index (trie->da, s);
-    suffix_idx = 0;
-    for ( ; ; p++) {
-        if (!tail_walk_char (trie->tail, s, &suffix_idx, *p))
-            return FALSE;
-        if (0 == *p)
-            break;
+    t = trie_da_get_tail_index (trie->da, s);
+    suffix = tail_get_suffix (trie->tail, t);
+    rest = key + len - p;
+    if (!suffix || 0 != strncmp ((const char *) suffix, (const char *) p, rest)
+        || TRIE_CHAR_TERM != suffix[rest])
+    {
+        return TRIE_INDEX_ERROR;
     }
 
+    if (o_sep)
+        *o_sep = s;
+    return t;
+}
+
+static Bool trie_has_key_codes (const Trie *trie, const TrieChar *key, size_t len) {
+    return TRIE_INDEX_ERROR != trie_find_tail (trie, key, len, NULL);
+}
+
+static Bool trie_retrieve_codes (const Trie *trie, const TrieChar *key, size_t len, TrieData *o_data) {
+    TrieIndex   t;
+
+    t = trie_find_tail (trie, key, len, NULL);
+    if (TRIE_INDEX_ERROR == t)
+        return FALSE;
+
     /* found, set the val and return */
     if (o_data)
-        *o_data = tail_get_data (trie->tail, s);
+        *o_data = tail_get_data (trie->tail, t);
     return TRUE;
 }
 
-Bool trie_delete (Trie *trie, const TrieChar *key) {
-    TrieIndex        s, t;
-    short            suffix_idx;
-    const TrieChar *p;
-
-    /* walk through branches */
-    s = da_get_root (trie->da);
-    for (p = key; !trie_da_is_separate (trie->da, s); p++) {
-        if (!da_walk (trie->da, &s, *p))
-            return FALSE;
-        if (0 == *p)
-            break;
-    }
+static Bool trie_delete_codes (Trie *trie, const TrieChar *key, size_t len) {
+    TrieIndex   s, t;
 
-    /* walk through tail */
-    t = trie_da_get_tail_index (trie->da, s);
-    suffix_idx = 0;
-    for ( ; ; p++) {
-        if (!tail_walk_char (trie->tail, t, &suffix_idx, *p))
-            return FALSE;
-        if (0 == *p)
-            break;
-    }
+    t = trie_find_tail (trie, key, len, &s);
+    if (TRIE_INDEX_ERROR == t)
+        return FALSE;
 
     tail_delete (trie->tail, t);
     da_set_base (trie->da, s, TRIE_INDEX_ERROR);
+    trie_reweigh (trie, s);
     da_prune (trie->da, s);
 
     //trie->is_dirty = TRUE;
     return TRUE;
 }
 
-/*-------------------------------*
- *   STEPWISE QUERY OPERATIONS   *
- *-------------------------------*/
+/* The public key operations translate the key through the alphabet map or
+ * the escaping, if needed, and then work on the codes. Stores always take
+ * a copy, as walking the tail needs the codes null-terminated.
+ */
 
-TrieState * trie_root (const Trie *trie) {
-    return trie_state_new (trie, da_get_root (trie->da), 0, FALSE);
+/* As trie_fetch_or_store(), but returns the separate node of the key. */
+static TrieIndex trie_fetch_or_store_node (Trie *trie, const TrieChar *key, size_t len, TrieData data, Bool *o_stored) {
+    TrieChar    buf[TRIE_KEY_BUF_SIZE], *codes;
+    size_t      codes_len;
+    TrieIndex   s;
+
+    codes = trie_map_key (trie->alpha_map, key, len, buf, &codes_len);
+    if (!codes)
+        return TRIE_INDEX_ERROR;
+    s = trie_insert_codes (trie, codes, codes_len, data, o_stored, NULL);
+    if (codes != buf)
+        free (codes);
+    if (TRIE_INDEX_ERROR != s && *o_stored)
+        trie_reweigh (trie, s);
+    return s;
 }
 
-/*----------------*
- *   TRIE STATE   *
- *----------------*/
+Bool trie_store_len (Trie *trie, const TrieChar *key, size_t len, TrieData data) {
+    TrieIndex   s;
+    Bool        stored;
 
-static TrieState * trie_state_new (const Trie *trie, TrieIndex index, short suffix_idx, short is_suffix) {
-    TrieState *s;
+    s = trie_fetch_or_store_node (trie, key, len, data, &stored);
+    if (TRIE_INDEX_ERROR == s)
+        return FALSE;
 
-    s = (TrieState *) malloc (sizeof (TrieState));
-    if (!s)
-        return NULL;
+    /* duplicated key, overwrite val */
+    if (!stored) {
+        tail_set_data (trie->tail, trie_da_get_tail_index (trie->da, s), data);
+        trie_reweigh (trie, s);
+    }
+    return TRUE;
+}
 
-    s->trie       = trie;
-    s->index      = index;
-    s->suffix_idx = suffix_idx;
-    s->is_suffix  = is_suffix;
+/* Find the data of a key in a single walk, storing the key with data first
+ * if it is absent, as told by *o_stored. The pointer returned stays valid
+ * until the next key is stored; NULL is returned on failure. With weights
+ * kept, trie_reweigh_len() must be called after writing through it.
+ */
+TrieData * trie_fetch_or_store (Trie *trie, const TrieChar *key, size_t len, TrieData data, Bool *o_stored) {
+    TrieIndex   s;
 
-    return s;
+    s = trie_fetch_or_store_node (trie, key, len, data, o_stored);
+    if (TRIE_INDEX_ERROR == s)
+        return NULL;
+    return tail_get_data_ptr (trie->tail,
+                              trie_da_get_tail_index (trie->da, s));
 }
 
-TrieState * trie_state_clone (const TrieState *s) {
-    return trie_state_new (s->trie, s->index, s->suffix_idx, s->is_suffix);
-}
+/* Store many keys with their data, given with their lengths, as by
+ * trie_store_len() for each in turn. Each walk starts from where the key
+ * parts from the one before, so keys in sorted order store fastest.
+ * Returns FALSE if any key fails to be stored.
+ */
+Bool trie_store_many (Trie *trie, const TrieChar *keys[], const size_t lens[], const TrieData data[], size_t num_keys) {
+    TrieChar    buf[TRIE_KEY_BUF_SIZE], *codes;
+    TriePath    path;
+    size_t      codes_len, i;
+    Bool        stored, ret;
 
-void trie_state_free (TrieState *s) {
-    free (s);
-}
+    path.alloc_states = 64;
+    path.states = (TrieIndex *) malloc (path.alloc_states * sizeof (TrieIndex));
+    path.alloc_key = TRIE_KEY_BUF_SIZE;
+    path.key = (TrieChar *) malloc (path.alloc_key);
+    if (!path.states || !path.key) {
+        free (path.states);
+        free (path.key);
+        return FALSE;
+    }
+    path.states[0] = da_get_root (trie->da);
+    path.num_states = 1;
+    path.key_len = 0;
 
-void trie_state_rewind (TrieState *s) {
-    s->index      = da_get_root (s->trie->da);
-    s->is_suffix  = FALSE;
-}
+    ret = TRUE;
+    for (i = 0; i < num_keys; i++) {
+        TrieIndex   s;
 
-Bool trie_state_walk (TrieState *s, TrieChar c) {
-    if (!s->is_suffix) {
-        Bool ret;
+        codes = trie_map_key (trie->alpha_map, keys[i], lens[i], buf,
+                              &codes_len);
+        if (!codes) {
+            ret = FALSE;
+            continue;
+        }
 
-        ret = da_walk (s->trie->da, &s->index, c);
+        s = trie_insert_codes (trie, codes, codes_len, data[i], &stored,
+                               &path);
+        if (TRIE_INDEX_ERROR == s) {
+            ret = FALSE;
+        } else {
+            if (!stored)
+                tail_set_data (trie->tail,
+                               trie_da_get_tail_index (trie->da, s), data[i]);
+            trie_reweigh (trie, s);
+        }
 
-        if (ret && trie_da_is_separate (s->trie->da, s->index)) {
-            s->index = trie_da_get_tail_index (s->trie->da, s->index);
-            s->suffix_idx = 0;
-            s->is_suffix = TRUE;
+        /* remember the codes the saved states were walked with */
+        if (codes_len > path.alloc_key) {
+            TrieChar   *key = (TrieChar *) realloc (path.key, codes_len);
+
+            if (key) {
+                path.key = key;
+                path.alloc_key = codes_len;
+            }
         }
+        path.key_len = MIN_VAL (codes_len, path.alloc_key);
+        memcpy (path.key, codes, path.key_len);
+        path.num_states = MIN_VAL (path.num_states, path.key_len + 1);
 
-        return ret;
-    } else {
-        return tail_walk_char (s->trie->tail, s->index, &s->suffix_idx, c);
+        if (codes != buf)
+            free (codes);
     }
+
+    free (path.states);
+    free (path.key);
+    return ret;
 }
 
-Bool trie_state_is_walkable (const TrieState *s, TrieChar c) {
-    if (!s->is_suffix)
-        return da_is_walkable (s->trie->da, s->index, c);
-    else 
-        return tail_is_walkable_char (s->trie->tail, s->index, s->suffix_idx, c);
+Bool trie_has_key_len (const Trie *trie, const TrieChar *key, size_t len) {
+    TrieChar    buf[TRIE_KEY_BUF_SIZE], *codes;
+    size_t      codes_len;
+    Bool        ret;
+
+    if (trie_key_is_plain (trie, key, len))
+        return trie_has_key_codes (trie, key, len);
+
+    codes = trie_map_key (trie->alpha_map, key, len, buf, &codes_len);
+    if (!codes)
+        return FALSE;
+    ret = trie_has_key_codes (trie, codes, codes_len);
+    if (codes != buf)
+        free (codes);
+    return ret;
+}
+
+Bool trie_retrieve_len (const Trie *trie, const TrieChar *key, size_t len, TrieData *o_data) {
+    TrieChar    buf[TRIE_KEY_BUF_SIZE], *codes;
+    size_t      codes_len;
+    Bool        ret;
+
+    if (trie_key_is_plain (trie, key, len))
+        return trie_retrieve_codes (trie, key, len, o_data);
+
+    codes = trie_map_key (trie->alpha_map, key, len, buf, &codes_len);
+    if (!codes)
+        return FALSE;
+    ret = trie_retrieve_codes (trie, codes, codes_len, o_data);
+    if (codes != buf)
+        free (codes);
+    return ret;
+}
+
+Bool trie_delete_len (Trie *trie, const TrieChar *key, size_t len) {
+    TrieChar    buf[TRIE_KEY_BUF_SIZE], *codes;
+    size_t      codes_len;
+    Bool        ret;
+
+    if (trie_key_is_plain (trie, key, len))
+        return trie_delete_codes (trie, key, len);
+
+    codes = trie_map_key (trie->alpha_map, key, len, buf, &codes_len);
+    if (!codes)
+        return FALSE;
+    ret = trie_delete_codes (trie, codes, codes_len);
+    if (codes != buf)
+        free (codes);
+    return ret;
+}
+
+Bool trie_store (Trie *trie, const TrieChar *key, TrieData data) {
+    return trie_store_len (trie, key, strlen ((const char *) key), data);
+}
+
+Bool trie_has_key (const Trie *trie, const TrieChar *key) {
+    return trie_has_key_len (trie, key, strlen ((const char *) key));
+}
+
+Bool trie_retrieve (const Trie *trie, const TrieChar *key, TrieData *o_data) {
+    return trie_retrieve_len (trie, key, strlen ((const char *) key), o_data);
+}
+
+Bool trie_delete (Trie *trie, const TrieChar *key) {
+    return trie_delete_len (trie, key, strlen ((const char *) key));
+}
+
+#define TRIE_BATCH_SIZE 8
+
+typedef struct {
+    const TrieChar *p, *end;
+    TrieIndex       s;          /**< state reached, TRIE_INDEX_ERROR if lost */
+    TrieIndex       next;       /**< state to check next, if pending */
+    Bool            pending;
+    TrieChar        c;          /**< label of next */
+    TrieChar       *codes;      /**< mapped key, if not looked up in place */
+} TrieWalk;
+
+static void trie_retrieve_batch (const Trie *trie, const TrieChar *keys[], const size_t lens[], int n, TrieData o_data[], Bool o_found[]) {
+    TrieChar        bufs[TRIE_BATCH_SIZE][TRIE_KEY_BUF_SIZE];
+    TrieWalk        w[TRIE_BATCH_SIZE];
+    const DArray   *da = trie->da;
+    Bool            active;
+    int             i;
+
+    for (i = 0; i < n; i++) {
+        const TrieChar *key = keys[i];
+        size_t          len = lens[i];
+
+        w[i].codes = NULL;
+        w[i].pending = FALSE;
+        w[i].s = da_get_root (da);
+        if (!trie_key_is_plain (trie, key, len)) {
+            w[i].codes = trie_map_key (trie->alpha_map, key, len, bufs[i], &len);
+            if (!w[i].codes)
+                w[i].s = TRIE_INDEX_ERROR;
+            key = w[i].codes;
+        }
+        w[i].p = key;
+        w[i].end = key + len;
+    }
+
+    /* walk through branches: each round checks the cell every walk
+     * prefetched in the previous round, and prefetches the next one */
+    do {
+        active = FALSE;
+        for (i = 0; i < n; i++) {
+            TrieWalk   *wi = &w[i];
+            TrieIndex   base;
+
+            if (TRIE_INDEX_ERROR == wi->s)
+                continue;
+            if (wi->pending) {
+                if (da_fast_get_check (da, wi->next) != wi->s) {
+                    wi->s = TRIE_INDEX_ERROR;
+                    continue;
+                }
+                wi->s = wi->next;
+                wi->pending = FALSE;
+                if (TRIE_CHAR_TERM == wi->c)
+                    continue;
+                ++wi->p;
+            }
+            base = da_fast_get_base (da, wi->s);
+            if (base < 0)
+                continue;
+            wi->c = (wi->p < wi->end) ? *wi->p : TRIE_CHAR_TERM;
+            wi->next = base + wi->c;
+            da_prefetch (da, wi->next);
+            wi->pending = active = TRUE;
+        }
+    } while (active);
+
+    /* fetch the tail blocks of all walks before comparing any suffix */
+    for (i = 0; i < n; i++) {
+        if (TRIE_INDEX_ERROR != w[i].s) {
+            w[i].s = trie_da_get_tail_index (da, w[i].s);
+            tail_prefetch (trie->tail, w[i].s);
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        const TrieChar *suffix;
+        size_t          rest;
+
+        o_found[i] = FALSE;
+        if (TRIE_INDEX_ERROR != w[i].s) {
+            suffix = tail_get_suffix (trie->tail, w[i].s);
+            rest = w[i].end - w[i].p;
+            if (suffix
+                && 0 == strncmp ((const char *) suffix,
+                                 (const char *) w[i].p, rest)
+                && TRIE_CHAR_TERM == suffix[rest])
+            {
+                o_found[i] = TRUE;
+                if (o_data)
+                    o_data[i] = tail_get_data (trie->tail, w[i].s);
+            }
+        }
+        if (w[i].codes && w[i].codes != bufs[i])
+            free (w[i].codes);
+    }
+}
+
+/* Look up many keys, given with their lengths, at once. Keys are taken in
+ * batches whose walks advance in lockstep, prefetching the cell each walk
+ * reads next, so that their cache misses overlap. Sets o_found[i], and
+ * o_data[i] for keys found if o_data is given.
+ */
+void trie_retrieve_many (const Trie *trie, const TrieChar *keys[], const size_t lens[], size_t num_keys, TrieData o_data[], Bool o_found[]) {
+    size_t  i;
+
+    for (i = 0; i < num_keys; i += TRIE_BATCH_SIZE) {
+        trie_retrieve_batch (trie, keys + i, lens + i,
+                             (int) MIN_VAL (TRIE_BATCH_SIZE, num_keys - i),
+                             o_data ? o_data + i : NULL, o_found + i);
+    }
+}
+/*-------------------------------*
+ *   STEPWISE QUERY OPERATIONS   *
+ *-------------------------------*/
+
+TrieState * trie_root (const Trie *trie) {
+    return trie_state_new (trie, da_get_root (trie->da), 0, FALSE);
+}
+
+/*----------------*
+ *   TRIE STATE   *
+ *----------------*/
+
+static TrieState * trie_state_new (const Trie *trie, TrieIndex index, int suffix_idx, short is_suffix) {
+    TrieState *s;
+
+    s = (TrieState *) malloc (sizeof (TrieState));
+    if (!s)
+        return NULL;
+
+    s->trie       = trie;
+    s->index      = index;
+    s->suffix_idx = suffix_idx;
+    s->is_suffix  = is_suffix;
+
+    return s;
+}
+
+TrieState * trie_state_clone (const TrieState *s) {
+    return trie_state_new (s->trie, s->index, s->suffix_idx, s->is_suffix);
+}
+
+void trie_state_free (TrieState *s) {
+    free (s);
+}
+
+void trie_state_rewind (TrieState *s) {
+    s->index      = da_get_root (s->trie->da);
+    s->is_suffix  = FALSE;
+}
+
+Bool trie_state_walk (TrieState *s, TrieChar c) {
+    if (s->trie->alpha_map) {
+        int tc = alpha_map_char_to_trie (s->trie->alpha_map, c);
+        if (tc < 0)
+            return FALSE;
+        c = (TrieChar) tc;
+    }
+
+    if (!s->is_suffix) {
+        Bool ret;
+
+        ret = da_walk (s->trie->da, &s->index, c);
+
+        if (ret && trie_da_is_separate (s->trie->da, s->index)) {
+            s->index = trie_da_get_tail_index (s->trie->da, s->index);
+            s->suffix_idx = 0;
+            s->is_suffix = TRUE;
+        }
+
+        return ret;
+    } else {
+        return tail_walk_char (s->trie->tail, s->index, &s->suffix_idx, c);
+    }
+}
+
+/* Walk one byte of a key the way the key operations translate it. The
+ * state is left undefined on failure.
+ */
+static Bool trie_state_walk_byte (TrieState *s, TrieChar c) {
+    if (s->trie->alpha_map)
+        return TRIE_CHAR_TERM != c && trie_state_walk (s, c);
+    if (trie_char_is_escaped (c))
+        return trie_state_walk (s, TRIE_CHAR_ESCAPE)
+               && trie_state_walk (s, c + 1);
+    return trie_state_walk (s, c);
+}
+
+/* Walk a key the way the key operations translate it. On failure, the
+ * state is left unchanged.
+ */
+Bool trie_state_walk_key (TrieState *s, const TrieChar *key, size_t len) {
+    TrieState   saved = *s;
+    size_t      i;
+
+    for (i = 0; i < len; i++) {
+        if (!trie_state_walk_byte (s, key[i]))
+            goto fail;
+    }
+    return TRUE;
+
+fail:
+    *s = saved;
+    return FALSE;
+}
+
+/* Walk str of len bytes from the root in one go, calling func with the
+ * length and data of each key that str begins with, shortest first, until
+ * it returns FALSE. The walk is made on a state kept on the stack, so
+ * nothing is allocated. Returns FALSE if func stopped the walk.
+ */
+Bool trie_walk_prefixes (const Trie *trie, const TrieChar *str, size_t len, TriePrefixFunc func, void *user_data) {
+    TrieState   s, t;
+    size_t      i;
+
+    s.trie = trie;
+    s.index = da_get_root (trie->da);
+    s.suffix_idx = 0;
+    s.is_suffix = FALSE;
+
+    for (i = 0; ; i++) {
+        if (trie_state_is_terminal (&s)) {
+            t = s;
+            trie_state_walk (&t, TRIE_CHAR_TERM);
+            if (!(*func) (i, trie_state_get_data (&t), user_data))
+                return FALSE;
+        }
+        if (i == len || !trie_state_walk_byte (&s, str[i]))
+            break;
+    }
+    return TRUE;
+}
+
+typedef struct {
+    Bool        found;
+    size_t      len;
+    TrieData    data;
+} TrieLongestPrefix;
+
+static Bool trie_note_prefix (size_t len, TrieData data, void *user_data) {
+    TrieLongestPrefix *longest = (TrieLongestPrefix *) user_data;
+
+    longest->found = TRUE;
+    longest->len = len;
+    longest->data = data;
+    return TRUE;
+}
+
+/* Find the longest key that str of len bytes begins with, setting *o_len
+ * to its length and *o_data to its data.
+ */
+Bool trie_longest_prefix (const Trie *trie, const TrieChar *str, size_t len, size_t *o_len, TrieData *o_data) {
+    TrieLongestPrefix   longest;
+
+    longest.found = FALSE;
+    trie_walk_prefixes (trie, str, len, trie_note_prefix, &longest);
+    if (!longest.found)
+        return FALSE;
+
+    *o_len = longest.len;
+    if (o_data)
+        *o_data = longest.data;
+    return TRUE;
+}
+
+/* Called by trie_walk_keys() with each key byte walked, at depth, to tell
+ * whether to go on below it; and with each key reached, to tell whether to
+ * go on with the walk.
+ */
+typedef Bool (*TrieWalkByteFunc) (void *ctx, size_t depth, TrieChar b);
+typedef Bool (*TrieWalkKeyFunc) (void *ctx, const TrieChar *key, size_t len, TrieData data);
+
+typedef struct {
+    TrieIndex   s;
+    int         c;          /**< next child label to walk, -1 when done */
+    size_t      depth;      /**< key bytes walked to s */
+    Bool        escaped;    /**< whether s was reached by TRIE_CHAR_ESCAPE */
+} TrieWalkFrame;
+
+/* A walk over the keys in key order, a key at a time. The walk keeps its
+ * own stack, so that long keys do not run out of C stack, and can be left
+ * at any key. If 'sep' is set, the walk starts along its suffix, with the
+ * key bytes walked to it; the stack is then empty. If 'keep' is set, only
+ * the keys it takes are given; 'ctx' is then owned by the walk, and freed
+ * with it by 'free_ctx'.
+ */
+struct _TrieIterator {
+    const Trie         *trie;
+    TrieChar           *key;
+    size_t              alloc_key;
+    TrieWalkFrame      *stack;
+    size_t              num_frames;
+    size_t              alloc_stack;
+    TrieIndex           sep;
+    size_t              sep_depth;
+    Bool                sep_escaped;
+    TrieWalkByteFunc    put;
+    TrieWalkKeyFunc     keep;
+    void              (*free_ctx) (void *ctx);
+    void               *ctx;
+    Bool                failed;
+};
+
+/* Translate a code walked from a state reached by an escape, or not, into
+ * a key byte. Returns FALSE for the escape itself, which gives no byte.
+ */
+static Bool trie_walk_byte (const Trie *trie, TrieChar c, Bool escaped, TrieChar *o_byte) {
+    if (trie->alpha_map) {
+        *o_byte = (TrieChar) alpha_map_trie_to_char (trie->alpha_map, c);
+        return TRUE;
+    }
+    if (escaped) {
+        *o_byte = c - 1;
+        return TRUE;
+    }
+    if (TRIE_CHAR_ESCAPE == c)
+        return FALSE;
+    *o_byte = c;
+    return TRUE;
+}
+
+static TrieIterator * trie_iterator_alloc (const Trie *trie, TrieWalkByteFunc put, void *ctx) {
+    TrieIterator   *it;
+
+    it = (TrieIterator *) calloc (1, sizeof (TrieIterator));
+    if (!it)
+        return NULL;
+
+    it->trie = trie;
+    it->alloc_key = 64;
+    it->key = (TrieChar *) malloc (it->alloc_key);
+    it->alloc_stack = 16;
+    it->stack = (TrieWalkFrame *) malloc (it->alloc_stack
+                                          * sizeof (TrieWalkFrame));
+    it->sep = TRIE_INDEX_ERROR;
+    it->put = put;
+    it->ctx = ctx;
+    if (!it->key || !it->stack) {
+        trie_iterator_free (it);
+        return NULL;
+    }
+    return it;
+}
+
+/* Go on below state s, reached by depth key bytes. */
+static Bool trie_iterator_push (TrieIterator *it, TrieIndex s, size_t depth, Bool escaped) {
+    TrieWalkFrame  *f;
+
+    if (it->num_frames == it->alloc_stack) {
+        TrieWalkFrame  *stack;
+
+        stack = (TrieWalkFrame *) realloc (it->stack, 2 * it->alloc_stack
+                                                      * sizeof (TrieWalkFrame));
+        if (!stack) {
+            it->failed = TRUE;
+            return FALSE;
+        }
+        it->stack = stack;
+        it->alloc_stack *= 2;
+    }
+
+    f = &it->stack[it->num_frames++];
+    f->s = s;
+    f->c = da_first_child (it->trie->da, s);
+    f->depth = depth;
+    f->escaped = escaped;
+    return TRUE;
+}
+
+/* Take the key byte b at depth, unless put turns it down. */
+static Bool trie_walk_put (TrieIterator *it, size_t depth, TrieChar b) {
+    if (depth == it->alloc_key) {
+        TrieChar   *key;
+
+        key = (TrieChar *) realloc (it->key, 2 * it->alloc_key);
+        if (!key) {
+            it->failed = TRUE;
+            return FALSE;
+        }
+        it->key = key;
+        it->alloc_key *= 2;
+    }
+    it->key[depth] = b;
+    return !it->put || (*it->put) (it->ctx, depth, b);
+}
+
+/* Go on along the suffix of separate node s, setting *o_len to the length
+ * of its key. Returns FALSE if put turned the key down.
+ */
+static Bool trie_walk_suffix (TrieIterator *it, TrieIndex s, size_t depth, Bool escaped, size_t *o_len) {
+    const TrieChar *p;
+    TrieChar        b;
+
+    p = tail_get_suffix (it->trie->tail, trie_da_get_tail_index (it->trie->da, s));
+    for (; p && *p; p++) {
+        if (!trie_walk_byte (it->trie, *p, escaped, &b)) {
+            escaped = TRUE;
+            continue;
+        }
+        escaped = FALSE;
+        if (!trie_walk_put (it, depth, b))
+            return FALSE;
+        ++depth;
+    }
+    *o_len = depth;
+    return TRUE;
+}
+
+/* Walk the keys starting with prefix, in key order. Returns NULL on
+ * failure.
+ */
+TrieIterator * trie_iterator_new (const Trie *trie, const TrieChar *prefix, size_t len) {
+    const DArray   *da = trie->da;
+    TrieIterator   *it;
+    TrieChar        buf[TRIE_KEY_BUF_SIZE], *codes, b;
+    TrieIndex       s;
+    size_t          codes_len, i, depth;
+    Bool            escaped;
+
+    it = trie_iterator_alloc (trie, NULL, NULL);
+    if (!it)
+        return NULL;
+
+    codes = trie_map_key (trie->alpha_map, prefix, len, buf, &codes_len);
+    if (!codes)
+        return it;
+
+    /* walk the prefix, taking its bytes as the start of the keys */
+    s = da_get_root (da);
+    depth = 0;
+    escaped = FALSE;
+    for (i = 0; i < codes_len && !trie_da_is_separate (da, s); i++) {
+        if (!da_walk (da, &s, codes[i])) {
+            s = TRIE_INDEX_ERROR;
+            break;
+        }
+        if (!trie_walk_byte (trie, codes[i], escaped, &b)) {
+            escaped = TRUE;
+            continue;
+        }
+        escaped = FALSE;
+        trie_walk_put (it, depth++, b);
+    }
+
+    if (TRIE_INDEX_ERROR != s && !it->failed) {
+        if (trie_da_is_separate (da, s)) {
+            const TrieChar *suffix;
+
+            /* the rest of the prefix must be in the suffix of the only key */
+            suffix = tail_get_suffix (trie->tail,
+                                      trie_da_get_tail_index (da, s));
+            if (suffix && 0 == strncmp ((const char *) suffix,
+                                        (const char *) codes + i,
+                                        codes_len - i))
+            {
+                it->sep = s;
+                it->sep_depth = depth;
+                it->sep_escaped = escaped;
+            }
+        } else {
+            trie_iterator_push (it, s, depth, escaped);
+        }
+    }
+
+    if (codes != buf)
+        free (codes);
+    return it;
+}
+
+/* Compare two keys in key order. */
+static int trie_key_cmp (const TrieChar *a, size_t a_len, const TrieChar *b, size_t b_len) {
+    int cmp = memcmp (a, b, MIN_VAL (a_len, b_len));
+
+    if (0 != cmp)
+        return cmp;
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+/* Skip the keys up to after, so that the walk goes on from the first key
+ * above it. This must be done before the first trie_iterator_next(). The
+ * walk is laid again along after, so that this costs about as much as a
+ * lookup, whatever the number of keys skipped.
+ */
+void trie_iterator_seek (TrieIterator *it, const TrieChar *after, size_t len) {
+    const Trie     *trie = it->trie;
+    const DArray   *da = trie->da;
+    TrieChar        buf[TRIE_KEY_BUF_SIZE], *codes, b;
+    TrieIndex       s, t;
+    size_t          codes_len, depth, rest, i, j;
+    Bool            escaped;
+    int             bound, c;
+
+    if (TRIE_INDEX_ERROR != it->sep) {
+        /* the walk is a single key; keep it if it is above after */
+        if (!trie_walk_suffix (it, it->sep, it->sep_depth, it->sep_escaped,
+                               &rest)
+            || trie_key_cmp (it->key, rest, after, len) <= 0)
+        {
+            it->sep = TRIE_INDEX_ERROR;
+        }
+        return;
+    }
+    if (1 != it->num_frames)
+        return;
+
+    /* the keys all start with the prefix walked to the frame, so unless
+     * after does too, they are all above it or all below */
+    s = it->stack[0].s;
+    depth = it->stack[0].depth;
+    if (len < depth || 0 != memcmp (it->key, after, depth)) {
+        if (trie_key_cmp (it->key, depth, after, len) < 0)
+            it->num_frames = 0;
+        return;
+    }
+
+    /* with an alphabet, after is walked up to its first byte outside it,
+     * and the keys going on with a larger byte there are above it */
+    bound = -1;
+    rest = len;
+    if (trie->alpha_map) {
+        for (j = depth; j < len; j++) {
+            if (alpha_map_char_to_trie (trie->alpha_map, after[j]) <= 0) {
+                bound = after[j];
+                rest = j;
+                break;
+            }
+        }
+    }
+    codes = trie_map_key (trie->alpha_map, after + depth, rest - depth, buf,
+                          &codes_len);
+    if (!codes) {
+        it->failed = TRUE;
+        return;
+    }
+
+    it->num_frames = 0;
+    escaped = FALSE;
+    for (i = 0; ; i++) {
+        if (!trie_iterator_push (it, s, depth, escaped))
+            break;
+
+        /* past the end of after, only the keys going on from here are
+         * above it, or with a bound, those going on above the bound */
+        if (i == codes_len) {
+            for (c = da_first_child (da, s); c >= 0;
+                 c = da_next_child (da, s, (TrieChar) c))
+            {
+                if (TRIE_CHAR_TERM == c)
+                    continue;
+                if (bound < 0 || alpha_map_trie_to_char (trie->alpha_map,
+                                                         (TrieChar) c)
+                                 > (AlphaChar) bound)
+                {
+                    break;
+                }
+            }
+            it->stack[it->num_frames - 1].c = c;
+            break;
+        }
+
+        /* the branches above the code of after come after it */
+        for (c = da_first_child (da, s); c >= 0 && c <= codes[i];
+             c = da_next_child (da, s, (TrieChar) c))
+        {
+            ;
+        }
+        it->stack[it->num_frames - 1].c = c;
+
+        t = s;
+        if (!da_walk (da, &t, codes[i]))
+            break;
+        if (!trie_walk_byte (trie, codes[i], escaped, &b)) {
+            escaped = TRUE;
+        } else {
+            escaped = FALSE;
+            if (!trie_walk_put (it, depth, b))
+                break;
+            ++depth;
+        }
+
+        if (trie_da_is_separate (da, t)) {
+            const TrieChar *suffix;
+            size_t          n, k;
+
+            /* the key of t is above after if its suffix is above the rest
+             * of after, or if after stops at a bound before it ends */
+            suffix = tail_get_suffix (trie->tail,
+                                      trie_da_get_tail_index (da, t));
+            if (!suffix)
+                break;
+            n = codes_len - (i + 1);
+            for (k = 0; k < n && suffix[k] == codes[i + 1 + k]; k++)
+                ;
+            if ((k < n && suffix[k] > codes[i + 1 + k])
+                || (k == n && TRIE_CHAR_TERM != suffix[k]
+                    && (bound < 0
+                        || alpha_map_trie_to_char (trie->alpha_map,
+                                                   suffix[k])
+                           > (AlphaChar) bound)))
+            {
+                it->sep = t;
+                it->sep_depth = depth;
+                it->sep_escaped = escaped;
+            }
+            break;
+        }
+        s = t;
+    }
+
+    if (codes != buf)
+        free (codes);
+}
+
+void trie_iterator_free (TrieIterator *it) {
+    if (it->free_ctx)
+        (*it->free_ctx) (it->ctx);
+    free (it->stack);
+    free (it->key);
+    free (it);
+}
+
+/* Move on to the next key walked, whether keep takes it or not. */
+static Bool trie_iterator_step (TrieIterator *it, const TrieChar **o_key, size_t *o_len, TrieData *o_data) {
+    const DArray   *da = it->trie->da;
+    TrieWalkFrame  *f;
+    TrieIndex       s, t;
+    size_t          depth;
+    TrieChar        b;
+    Bool            escaped;
+    int             c;
+
+    if (TRIE_INDEX_ERROR != it->sep) {
+        s = it->sep;
+        it->sep = TRIE_INDEX_ERROR;
+        if (trie_walk_suffix (it, s, it->sep_depth, it->sep_escaped, o_len))
+            goto found;
+        return FALSE;
+    }
+
+    while (it->num_frames > 0 && !it->failed) {
+        f = &it->stack[it->num_frames - 1];
+        if (f->c < 0) {
+            --it->num_frames;
+            continue;
+        }
+
+        c = f->c;
+        f->c = da_next_child (da, f->s, (TrieChar) c);
+        s = f->s;
+        da_walk (da, &s, (TrieChar) c);
+
+        depth = f->depth;
+        escaped = FALSE;
+        if (TRIE_CHAR_TERM == c) {
+            *o_len = depth;
+            goto found;
+        }
+        if (!trie_walk_byte (it->trie, (TrieChar) c, f->escaped, &b)) {
+            escaped = TRUE;
+        } else {
+            if (!trie_walk_put (it, depth, b))
+                continue;
+            ++depth;
+        }
+
+        if (trie_da_is_separate (da, s)) {
+            if (trie_walk_suffix (it, s, depth, escaped, o_len))
+                goto found;
+            continue;
+        }
+        trie_iterator_push (it, s, depth, escaped);
+    }
+    return FALSE;
+
+found:
+    t = trie_da_get_tail_index (da, s);
+    *o_key = it->key;
+    *o_data = tail_get_data (it->trie->tail, t);
+    return TRUE;
+}
+
+/* Move on to the next key, setting *o_key to its bytes, which stay valid
+ * until the next call, *o_len to its length and *o_data to its data.
+ * Returns FALSE once there are no more keys, or on failure.
+ */
+Bool trie_iterator_next (TrieIterator *it, const TrieChar **o_key, size_t *o_len, TrieData *o_data) {
+    while (trie_iterator_step (it, o_key, o_len, o_data)) {
+        if (!it->keep || (*it->keep) (it->ctx, *o_key, *o_len, *o_data))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/* Tell whether a walk stopped for lack of memory. */
+Bool trie_iterator_failed (const TrieIterator *it) {
+    return it->failed;
+}
+
+/* Walk all the keys in key order, giving put each key byte and found each
+ * key reached. Branches put turns down are left. Returns FALSE on failure.
+ */
+static Bool trie_walk_keys (const Trie *trie, TrieWalkByteFunc put, TrieWalkKeyFunc found, void *ctx) {
+    TrieIterator   *it;
+    const TrieChar *key;
+    size_t          len;
+    TrieData        data;
+    Bool            ret;
+
+    it = trie_iterator_alloc (trie, put, ctx);
+    if (!it)
+        return FALSE;
+
+    trie_iterator_push (it, da_get_root (trie->da), 0, FALSE);
+    while (trie_iterator_next (it, &key, &len, &data)) {
+        if (!(*found) (ctx, key, len, data))
+            break;
+    }
+
+    ret = !it->failed;
+    trie_iterator_free (it);
+    return ret;
+}
+
+/* rows[d * (len + 1) + j] is the edit distance between the first d bytes
+ * of the key walked and the first j bytes of the word. Only the band of j
+ * within max_dist of d is kept, as any distance outside it is over the
+ * bound; max_dist + 1 stands for such distances on either side of it.
+ */
+typedef struct {
+    const TrieChar *word;
+    size_t          len;
+    int             max_dist;
+    int            *rows;
+    size_t          alloc_rows;
+    Bool            failed;
+    TrieFuzzyFunc   func;
+    void           *user_data;
+} TrieFuzzy;
+
+/* Set the distance row after the key byte at depth. Returns FALSE if no
+ * key going on from there can be within the bound.
+ */
+static Bool trie_fuzzy_put (void *ctx, size_t depth, TrieChar b) {
+    TrieFuzzy  *fz = (TrieFuzzy *) ctx;
+    const int  *prev;
+    int        *row, min;
+    size_t      j, lo, hi;
+
+    if (depth + 2 > fz->alloc_rows) {
+        size_t      new_size = 2 * (depth + 2);
+        int        *rows;
+
+        rows = (int *) realloc (fz->rows,
+                                new_size * (fz->len + 1) * sizeof (int));
+        if (!rows) {
+            fz->failed = TRUE;
+            return FALSE;
+        }
+        fz->rows = rows;
+        fz->alloc_rows = new_size;
+    }
+
+    prev = fz->rows + depth * (fz->len + 1);
+    row = fz->rows + (depth + 1) * (fz->len + 1);
+    row[0] = min = prev[0] + 1;
+    lo = (depth + 1 > (size_t) fz->max_dist) ? depth + 1 - fz->max_dist : 1;
+    hi = MIN_VAL (fz->len, depth + 1 + fz->max_dist);
+    if (lo > 1 && lo <= fz->len)
+        row[lo - 1] = fz->max_dist + 1;
+    for (j = lo; j <= hi; j++) {
+        int d = prev[j - 1] + (fz->word[j - 1] != b);
+
+        d = MIN_VAL (d, prev[j] + 1);
+        d = MIN_VAL (d, row[j - 1] + 1);
+        row[j] = d;
+        min = MIN_VAL (min, d);
+    }
+    if (hi < fz->len)
+        row[hi + 1] = fz->max_dist + 1;
+    return min <= fz->max_dist;
+}
+
+/* Report the key if it is near enough. */
+static Bool trie_fuzzy_found (void *ctx, const TrieChar *key, size_t len, TrieData data) {
+    TrieFuzzy  *fz = (TrieFuzzy *) ctx;
+    int         dist;
+
+    /* the end of the word is outside the band */
+    if (len + fz->max_dist < fz->len)
+        return TRUE;
+    dist = fz->rows[len * (fz->len + 1) + fz->len];
+    if (dist > fz->max_dist)
+        return TRUE;
+    return (*fz->func) (key, len, dist, data, fz->user_data);
+}
+
+/* Find the keys within max_dist edits (insertions, deletions and
+ * substitutions of bytes) of word of len bytes, calling func with each
+ * key, its distance and data, in key order, until it returns FALSE. The
+ * walk keeps a row of distances per key byte, and leaves any branch whose
+ * row has no distance within the bound. Returns FALSE on failure.
+ */
+Bool trie_fuzzy (const Trie *trie, const TrieChar *word, size_t len, int max_dist, TrieFuzzyFunc func, void *user_data) {
+    TrieFuzzy   fz;
+    size_t      j;
+    Bool        ret;
+
+    if (max_dist < 0)
+        return TRUE;
+
+    fz.word = word;
+    fz.len = len;
+    fz.max_dist = max_dist;
+    fz.alloc_rows = 16;
+    fz.rows = (int *) malloc (fz.alloc_rows * (len + 1) * sizeof (int));
+    fz.failed = FALSE;
+    fz.func = func;
+    fz.user_data = user_data;
+    if (!fz.rows)
+        return FALSE;
+
+    for (j = 0; j <= len; j++)
+        fz.rows[j] = (int) j;
+
+    ret = trie_walk_keys (trie, trie_fuzzy_put, trie_fuzzy_found, &fz);
+    free (fz.rows);
+    return ret && !fz.failed;
+}
+
+/* A pattern is a row of elements, each either a '*' or the set of bytes
+ * one byte may be. A walk through it keeps the set of positions a key
+ * walked so far can have reached, as a bit set of num_elems + 1 bits per
+ * key byte; reaching position num_elems is matching.
+ */
+typedef struct {
+    Bool        star;
+    uint32      bytes[(TRIE_CHAR_MAX + 1) / 32];
+} TriePatternElem;
+
+struct _TriePattern {
+    TriePatternElem    *elems;
+    int                 num_elems;
+};
+
+#define trie_pattern_has(e,b)   ((e)->bytes[(b) / 32] & (1u << ((b) % 32)))
+#define trie_pattern_add(e,b)   ((e)->bytes[(b) / 32] |= (1u << ((b) % 32)))
+
+/* Parse the class of a '[' at *p, up to its ']', into e, leaving *p after
+ * it. Returns FALSE if the class is not closed.
+ */
+static Bool trie_pattern_class (TriePatternElem *e, const TrieChar **p, const TrieChar *end) {
+    const TrieChar *q = *p + 1;
+    Bool            negate = FALSE;
+    int             i, c, last;
+
+    if (q < end && ('^' == *q || '!' == *q)) {
+        negate = TRUE;
+        ++q;
+    }
+    /* a ']' first stands for itself */
+    for (c = -1; q < end && (']' != *q || -1 == c); ) {
+        if ('\\' == *q && q + 1 < end)
+            ++q;
+        c = *q++;
+        last = c;
+        if (q + 1 < end && '-' == *q && ']' != q[1]) {
+            ++q;
+            if ('\\' == *q && q + 1 < end)
+                ++q;
+            last = *q++;
+        }
+        for (i = c; i <= last; i++)
+            trie_pattern_add (e, i);
+    }
+    if (q == end)
+        return FALSE;
+
+    if (negate) {
+        for (i = 0; i < (TRIE_CHAR_MAX + 1) / 32; i++)
+            e->bytes[i] = ~e->bytes[i];
+    }
+    *p = q + 1;
+    return TRUE;
+}
+
+/* Compile a pattern of len bytes, in which '?' stands for any byte, '*'
+ * for any run of bytes, '[...]' for any byte of a class of bytes and
+ * ranges, '[^...]' or '[!...]' for any byte out of one, and '\' makes the
+ * next byte stand for itself. Returns NULL if a class is not closed, or
+ * on failure.
+ */
+TriePattern * trie_pattern_new (const TrieChar *pattern, size_t len) {
+    TriePattern    *pat;
+    const TrieChar *p, *end;
+    TriePatternElem *e;
+    int             i;
+
+    pat = (TriePattern *) malloc (sizeof (TriePattern));
+    if (!pat)
+        return NULL;
+    pat->elems = (TriePatternElem *) calloc (MAX_VAL (len, 1),
+                                             sizeof (TriePatternElem));
+    if (!pat->elems)
+        goto exit_pattern_created;
+
+    pat->num_elems = 0;
+    for (p = pattern, end = pattern + len; p < end; ) {
+        e = &pat->elems[pat->num_elems];
+        if ('*' == *p) {
+            p++;
+            /* runs of '*' are as one */
+            if (pat->num_elems > 0 && e[-1].star)
+                continue;
+            e->star = TRUE;
+        } else if ('?' == *p) {
+            p++;
+            for (i = 0; i < (TRIE_CHAR_MAX + 1) / 32; i++)
+                e->bytes[i] = ~(uint32) 0;
+        } else if ('[' == *p) {
+            if (!trie_pattern_class (e, &p, end))
+                goto exit_elems_created;
+        } else {
+            if ('\\' == *p && p + 1 < end)
+                p++;
+            trie_pattern_add (e, *p);
+            p++;
+        }
+        pat->num_elems++;
+    }
+    return pat;
+
+exit_elems_created:
+    free (pat->elems);
+exit_pattern_created:
+    free (pat);
+    return NULL;
+}
+
+void trie_pattern_free (TriePattern *pattern) {
+    free (pattern->elems);
+    free (pattern);
+}
+
+typedef struct {
+    const TriePattern  *pat;
+    int                 num_words;  /**< uint32 words per position set */
+    uint32             *sets;
+    size_t              alloc_sets;
+    TrieIterator       *it;         /**< the walk, to tell of a failure */
+} TrieMatch;
+
+#define trie_match_has(set,i)   ((set)[(i) / 32] & (1u << ((i) % 32)))
+#define trie_match_add(set,i)   ((set)[(i) / 32] |= (1u << ((i) % 32)))
+
+/* Add the positions a '*' can be passed to without a byte. */
+static void trie_match_close (const TriePattern *pat, uint32 *set) {
+    int i;
+
+    for (i = 0; i < pat->num_elems; i++) {
+        if (pat->elems[i].star && trie_match_has (set, i))
+            trie_match_add (set, i + 1);
+    }
+}
+
+/* Set the positions after the key byte at depth. Returns FALSE if none
+ * is left.
+ */
+static Bool trie_match_put (void *ctx, size_t depth, TrieChar b) {
+    TrieMatch          *m = (TrieMatch *) ctx;
+    const TriePattern  *pat = m->pat;
+    const uint32       *prev;
+    uint32             *set, any;
+    int                 i, n = pat->num_elems;
+
+    if (depth + 2 > m->alloc_sets) {
+        size_t      new_size = 2 * (depth + 2);
+        uint32     *sets;
+
+        sets = (uint32 *) realloc (m->sets,
+                                   new_size * m->num_words * sizeof (uint32));
+        if (!sets) {
+            m->it->failed = TRUE;
+            return FALSE;
+        }
+        m->sets = sets;
+        m->alloc_sets = new_size;
+    }
+
+    prev = m->sets + depth * m->num_words;
+    set = m->sets + (depth + 1) * m->num_words;
+
+    /* past a closing '*', any key below matches */
+    if (n > 0 && pat->elems[n - 1].star && trie_match_has (prev, n - 1)) {
+        memcpy (set, prev, m->num_words * sizeof (uint32));
+        return TRUE;
+    }
+
+    memset (set, 0, m->num_words * sizeof (uint32));
+    for (i = 0; i < n; i++) {
+        if (!trie_match_has (prev, i))
+            continue;
+        if (pat->elems[i].star)
+            trie_match_add (set, i);
+        else if (trie_pattern_has (&pat->elems[i], b))
+            trie_match_add (set, i + 1);
+    }
+    trie_match_close (pat, set);
+
+    for (i = 0, any = 0; i < m->num_words; i++)
+        any |= set[i];
+    return 0 != any;
+}
+
+/* Take a key if it reached the end of the pattern. */
+static Bool trie_match_keep (void *ctx, const TrieChar *key, size_t len, TrieData data) {
+    TrieMatch  *m = (TrieMatch *) ctx;
+
+    return trie_match_has (m->sets + len * m->num_words, m->pat->num_elems);
+}
+
+static void trie_match_free (void *ctx) {
+    TrieMatch  *m = (TrieMatch *) ctx;
+
+    free (m->sets);
+    free (m);
+}
+
+/* Walk the keys matching a pattern, in key order. The walk keeps the set
+ * of pattern positions per key byte, and leaves any branch with none
+ * left. The pattern must outlive the walk. Returns NULL on failure.
+ */
+TrieIterator * trie_iterator_new_match (const Trie *trie, const TriePattern *pattern) {
+    TrieMatch      *m;
+    TrieIterator   *it;
+
+    m = (TrieMatch *) malloc (sizeof (TrieMatch));
+    if (!m)
+        return NULL;
+    m->pat = pattern;
+    m->num_words = pattern->num_elems / 32 + 1;
+    m->alloc_sets = 16;
+    m->sets = (uint32 *) calloc (m->alloc_sets * m->num_words,
+                                 sizeof (uint32));
+    if (!m->sets) {
+        free (m);
+        return NULL;
+    }
+    trie_match_add (m->sets, 0);
+    trie_match_close (pattern, m->sets);
+
+    it = trie_iterator_alloc (trie, trie_match_put, m);
+    if (!it) {
+        trie_match_free (m);
+        return NULL;
+    }
+    it->keep = trie_match_keep;
+    it->free_ctx = trie_match_free;
+    m->it = it;
+
+    trie_iterator_push (it, da_get_root (trie->da), 0, FALSE);
+    return it;
+}
+
+/* Keep the weight of each state from now on, as the heaviest key below it
+ * by weigh, so that trie_top_k() can be used. Returns FALSE on failure.
+ */
+Bool trie_keep_weights (Trie *trie, TrieWeightFunc weigh) {
+    trie->weigh = weigh;
+    if (!trie_weigh_all (trie)) {
+        trie->weigh = NULL;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Bring the weights up to date after writing the data of a key through
+ * the pointer from trie_fetch_or_store().
+ */
+void trie_reweigh_len (Trie *trie, const TrieChar *key, size_t len) {
+    TrieChar    buf[TRIE_KEY_BUF_SIZE], *codes;
+    size_t      codes_len;
+    TrieIndex   s;
+
+    if (!trie->weigh)
+        return;
+
+    codes = trie_map_key (trie->alpha_map, key, len, buf, &codes_len);
+    if (!codes)
+        return;
+    if (TRIE_INDEX_ERROR != trie_find_tail (trie, codes, codes_len, &s))
+        trie_reweigh (trie, s);
+    if (codes != buf)
+        free (codes);
+}
+
+typedef struct {
+    int64_t     weight;
+    TrieIndex   s;
+} TrieRank;
+
+/* Sift heap[i] up a max-heap by weight. */
+static void trie_rank_up (TrieRank *heap, size_t i) {
+    TrieRank    r = heap[i];
+
+    while (i > 0 && heap[(i - 1) / 2].weight < r.weight) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = r;
+}
+
+/* Sift heap[0] down a max-heap of n ranks by weight. */
+static void trie_rank_down (TrieRank *heap, size_t n) {
+    TrieRank    r = heap[0];
+    size_t      i, j;
+
+    for (i = 0; (j = 2 * i + 1) < n; i = j) {
+        if (j + 1 < n && heap[j + 1].weight > heap[j].weight)
+            ++j;
+        if (heap[j].weight <= r.weight)
+            break;
+        heap[i] = heap[j];
+    }
+    heap[i] = r;
+}
+
+/* Spell out the key of separate node s, from the labels up to the root and
+ * on along its suffix, into *key as bytes, growing it as needed. Returns
+ * FALSE on failure.
+ */
+static Bool trie_spell_key (const Trie *trie, TrieIndex s, TrieChar **key, size_t *alloc_key, size_t *o_len) {
+    const DArray   *da = trie->da;
+    const TrieChar *suffix;
+    TrieIndex       root, t, p;
+    size_t          depth, size, i, n;
+    TrieChar        b;
+    Bool            escaped;
+
+    suffix = tail_get_suffix (trie->tail, trie_da_get_tail_index (da, s));
+    if (!suffix)
+        return FALSE;
+
+    root = da_get_root (da);
+    for (depth = 0, t = s; root != t; t = da_get_check (da, t))
+        ++depth;
+    size = depth + strlen ((const char *) suffix);
+    if (size > *alloc_key) {
+        TrieChar   *new_key = (TrieChar *) realloc (*key, size);
+
+        if (!new_key)
+            return FALSE;
+        *key = new_key;
+        *alloc_key = size;
+    }
+
+    for (i = depth, t = s; root != t; t = p) {
+        p = da_get_check (da, t);
+        (*key)[--i] = (TrieChar) (t - da_get_base (da, p));
+    }
+    memcpy (*key + depth, suffix, size - depth);
+
+    /* decode in place, as no code gives more than a byte */
+    escaped = FALSE;
+    for (i = n = 0; i < size && TRIE_CHAR_TERM != (*key)[i]; i++) {
+        if (!trie_walk_byte (trie, (*key)[i], escaped, &b)) {
+            escaped = TRUE;
+            continue;
+        }
+        escaped = FALSE;
+        (*key)[n++] = b;
+    }
+
+    *o_len = n;
+    return TRUE;
+}
+
+/* Find the k heaviest keys starting with prefix, calling func with each key
+ * and its data, heaviest first, until it returns FALSE. Keys of the same
+ * weight come in no particular order, and keys weighing TRIE_WEIGHT_NONE
+ * are left out. The search is best first: a heap holds the states next to
+ * those expanded, by the weight of the heaviest key below them, so that
+ * only the branches leading to the keys found are ever expanded. Weights
+ * must be kept, see trie_keep_weights(). Returns FALSE on failure.
+ */
+Bool trie_top_k (const Trie *trie, const TrieChar *prefix, size_t len, size_t k, TrieKeyFunc func, void *user_data) {
+    const DArray   *da = trie->da;
+    TrieChar        buf[TRIE_KEY_BUF_SIZE], *codes, *key;
+    TrieRank       *heap, top;
+    size_t          codes_len, i, n, alloc_heap, alloc_key, key_len;
+    TrieIndex       s, base;
+    Bool            ret;
+    int             c;
+
+    if (!trie->weigh)
+        return FALSE;
+
+    codes = trie_map_key (trie->alpha_map, prefix, len, buf, &codes_len);
+    if (!codes)
+        return TRUE;
+
+    /* walk the prefix, on into the suffix if it goes past the branches */
+    s = da_get_root (da);
+    for (i = 0; i < codes_len && !trie_da_is_separate (da, s); i++) {
+        if (!da_walk (da, &s, codes[i])) {
+            s = TRIE_INDEX_ERROR;
+            break;
+        }
+    }
+    if (TRIE_INDEX_ERROR != s && i < codes_len) {
+        const TrieChar *suffix;
+
+        suffix = tail_get_suffix (trie->tail, trie_da_get_tail_index (da, s));
+        if (!suffix || 0 != strncmp ((const char *) suffix,
+                                     (const char *) codes + i, codes_len - i))
+        {
+            s = TRIE_INDEX_ERROR;
+        }
+    }
+    if (codes != buf)
+        free (codes);
+    if (0 == k || TRIE_INDEX_ERROR == s
+        || TRIE_WEIGHT_NONE == da_get_weight (da, s))
+    {
+        return TRUE;
+    }
+
+    ret = FALSE;
+    alloc_heap = 64;
+    heap = (TrieRank *) malloc (alloc_heap * sizeof (TrieRank));
+    alloc_key = 64;
+    key = (TrieChar *) malloc (alloc_key);
+    if (!heap || !key)
+        goto exit_allocated;
+
+    heap[0].weight = da_get_weight (da, s);
+    heap[0].s = s;
+    n = 1;
+    while (n > 0 && k > 0) {
+        top = heap[0];
+        heap[0] = heap[--n];
+        trie_rank_down (heap, n);
+
+        base = da_get_base (da, top.s);
+        if (base < 0) {
+            if (!trie_spell_key (trie, top.s, &key, &alloc_key, &key_len))
+                goto exit_allocated;
+            --k;
+            if (!(*func) (key, key_len, tail_get_data (trie->tail, -base),
+                          user_data))
+            {
+                break;
+            }
+            continue;
+        }
+
+        for (c = da_first_child (da, top.s); c >= 0;
+             c = da_next_child (da, top.s, c))
+        {
+            if (TRIE_WEIGHT_NONE == da_get_weight (da, base + c))
+                continue;
+            if (n == alloc_heap) {
+                TrieRank   *new_heap;
+
+                new_heap = (TrieRank *) realloc (heap, 2 * alloc_heap
+                                                       * sizeof (TrieRank));
+                if (!new_heap)
+                    goto exit_allocated;
+                heap = new_heap;
+                alloc_heap *= 2;
+            }
+            heap[n].weight = da_get_weight (da, base + c);
+            heap[n].s = base + c;
+            trie_rank_up (heap, n++);
+        }
+    }
+    ret = TRUE;
+
+exit_allocated:
+    free (heap);
+    free (key);
+    return ret;
+}
+
+Bool trie_state_is_walkable (const TrieState *s, TrieChar c) {
+    if (s->trie->alpha_map) {
+        int tc = alpha_map_char_to_trie (s->trie->alpha_map, c);
+        if (tc < 0)
+            return FALSE;
+        c = (TrieChar) tc;
+    }
+
+    if (!s->is_suffix)
+        return da_is_walkable (s->trie->da, s->index, c);
+    else 
+        return tail_is_walkable_char (s->trie->tail, s->index, s->suffix_idx, c);
+}
+
+int trie_state_walkable_chars (const TrieState *s, TrieChar chars[], int chars_nelm) {
+    int n = 0;
+
+    if (!s->is_suffix) {
+        int c;
+
+        for (c = da_first_child (s->trie->da, s->index);
+             c >= 0 && n < chars_nelm;
+             c = da_next_child (s->trie->da, s->index, c))
+        {
+            chars[n++] = (TrieChar) c;
+        }
+    } else if (chars_nelm > 0) {
+        chars[n++] = tail_get_suffix (s->trie->tail, s->index) [s->suffix_idx];
+    }
+
+    if (s->trie->alpha_map) {
+        int i;
+
+        for (i = 0; i < n; i++)
+            chars[i] = (TrieChar) alpha_map_trie_to_char (s->trie->alpha_map, chars[i]);
+    }
+
+    return n;
 }
 
 Bool trie_state_is_leaf (const TrieState *s) {
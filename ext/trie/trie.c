@@ -1,10 +1,11 @@
 #include "ruby.h"
 #include "trie.h"
+#include "scanner.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
-VALUE cTrie, cTrieNode;
+VALUE cTrie, cTrieNode, cTrieScanner, cTrieScannerStream;
 
 /*
  * Document-class: Trie
@@ -19,6 +20,66 @@ static VALUE rb_trie_alloc(VALUE klass) {
 	return obj;
 }
 
+/*
+ * call-seq:
+ *   new -> Trie
+ *   new(:capacity => num_keys, :avg_key_len => len) -> Trie
+ *   new(:alphabet => chars) -> Trie
+ *
+ * Creates an empty Trie.  If you know roughly how many keys you will add, pass it as :capacity
+ * so that storage for them is allocated up front rather than grown while adding.  Passing their
+ * average length as :avg_key_len as well allocates storage for the keys' text up front too.
+ *
+ * If all keys are made of a small set of characters, pass them as a String in :alphabet, such as
+ * <tt>'abcdefghijklmnopqrstuvwxyz0123456789'</tt>.  The Trie then takes less memory and walks its
+ * nodes faster.  Keys with other characters can not be added, and are never found.
+ *
+ */
+static VALUE rb_trie_initialize(int argc, VALUE *argv, VALUE self) {
+    VALUE opts, capacity, avg_key_len, alphabet;
+    rb_scan_args(argc, argv, "01", &opts);
+
+    if(NIL_P(opts))
+        return self;
+    Check_Type(opts, T_HASH);
+
+    Trie *trie;
+    Data_Get_Struct(self, Trie, trie);
+
+    capacity = rb_hash_aref(opts, ID2SYM(rb_intern("capacity")));
+    avg_key_len = rb_hash_aref(opts, ID2SYM(rb_intern("avg_key_len")));
+    if(!NIL_P(capacity)) {
+        long num_keys = NUM2LONG(capacity);
+        long key_len = NIL_P(avg_key_len) ? 0 : NUM2LONG(avg_key_len);
+        if(num_keys < 0 || num_keys > TRIE_INDEX_MAX / 2)
+            rb_raise(rb_eArgError, "capacity out of range");
+        if(key_len < 0 || (num_keys > 0 && key_len > LONG_MAX / num_keys))
+            rb_raise(rb_eArgError, "avg_key_len out of range");
+        if(!trie_reserve(trie, (TrieIndex)num_keys, (size_t)key_len))
+            rb_raise(rb_eNoMemError, "failed to allocate trie capacity");
+    }
+
+    alphabet = rb_hash_aref(opts, ID2SYM(rb_intern("alphabet")));
+    if(!NIL_P(alphabet)) {
+        StringValue(alphabet);
+        AlphaMap *alpha_map = alpha_map_new();
+        if(!alpha_map)
+            rb_raise(rb_eNoMemError, "failed to allocate trie alphabet");
+
+        long i;
+        for(i = 0; i < RSTRING_LEN(alphabet); i++) {
+            AlphaChar c = (unsigned char)RSTRING_PTR(alphabet)[i];
+            if(alpha_map_add_range(alpha_map, c, c) != 0) {
+                alpha_map_free(alpha_map);
+                rb_raise(rb_eArgError, "alphabet can not contain null bytes");
+            }
+        }
+        trie_set_alpha_map(trie, alpha_map);
+    }
+
+    return self;
+}
+
 void raise_ioerror(const char * message) {
     VALUE rb_eIOError = rb_const_get(rb_cObject, rb_intern("IOError"));
     rb_raise(rb_eIOError, "%s", message);
@@ -52,6 +113,7 @@ static VALUE rb_trie_read(VALUE self, VALUE filename_base) {
     raise_ioerror("Error reading .da file.");
 
   trie->da = da_read(da_file);
+  trie_set_alpha_map(trie, alpha_map_read(da_file));
   fclose(da_file);
 
   FILE *tail_file = fopen(RSTRING_PTR(tail_filename), "r");
@@ -64,9 +126,151 @@ static VALUE rb_trie_read(VALUE self, VALUE filename_base) {
   da_free(old_da);
   tail_free(old_tail);
 
+  if (trie->da && trie->tail && !trie_escape_raw_keys(trie))
+    raise_ioerror("Error escaping keys of old .tail file.");
+
   return obj;
 }
 
+/* Keys are given to trie_build as codes, escaped if they hold bytes the
+ * trie itself uses. */
+static VALUE key_codes(VALUE key) {
+    StringValue(key);
+    if(memchr(RSTRING_PTR(key), '\0', RSTRING_LEN(key)) == NULL &&
+       memchr(RSTRING_PTR(key), '\1', RSTRING_LEN(key)) == NULL)
+        return rb_str_new(RSTRING_PTR(key), RSTRING_LEN(key));
+
+    size_t len;
+    TrieChar *codes = trie_escape_key((TrieChar*)RSTRING_PTR(key), RSTRING_LEN(key), &len);
+    if(!codes)
+        rb_raise(rb_eNoMemError, "failed to escape key");
+    VALUE str = rb_str_new((char*)codes, len);
+    free(codes);
+    return str;
+}
+
+/* Turns the characters walked from the root back into a key. */
+static VALUE key_string(Trie *trie, VALUE prefix, long len) {
+    VALUE str = rb_str_new(RSTRING_PTR(prefix), len);
+    if(!trie->alpha_map)
+        rb_str_set_len(str, trie_unescape_key((TrieChar*)RSTRING_PTR(str), len));
+    return str;
+}
+
+/* The characters to start walking from a prefix with, as key_string expects them. */
+static VALUE prefix_buffer(Trie *trie, VALUE prefix) {
+    return trie->alpha_map ? rb_str_dup(prefix) : key_codes(prefix);
+}
+
+/* Walks that yield to a block count themselves in the trie while they run, so that the block can not
+ * change the trie under them. */
+static void check_unwalked(Trie *trie) {
+    if(trie->num_walks > 0)
+        rb_raise(rb_eRuntimeError, "can't modify trie during iteration");
+}
+
+static VALUE end_walk(VALUE self) {
+    Trie *trie;
+    Data_Get_Struct(self, Trie, trie);
+    trie->num_walks--;
+    return Qnil;
+}
+
+/* Calls body(arg) as a walk of the trie of self. */
+static VALUE guard_walk(VALUE self, VALUE (*body)(VALUE), VALUE arg) {
+    Trie *trie;
+    Data_Get_Struct(self, Trie, trie);
+    trie->num_walks++;
+    return rb_ensure(body, arg, end_walk, self);
+}
+
+typedef struct {
+    const TrieChar *key;
+    TrieData        data;
+    long            order;
+} BuildEntry;
+
+static int build_entry_cmp(const void *a, const void *b) {
+    const BuildEntry *x = (const BuildEntry *)a, *y = (const BuildEntry *)b;
+    int cmp = strcmp((const char *)x->key, (const char *)y->key);
+    if(cmp != 0)
+        return cmp;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/*
+ * call-seq:
+ *   build(keys) -> Trie
+ *   build([ [key,value], ... ]) -> Trie
+ *   build(hash) -> Trie
+ *
+ * Returns a new trie holding the given keys, or keys and values.  This is much faster than adding
+ * the keys one by one, as each node of the trie is laid out once, knowing all of its children.
+ * Keys are fastest given already sorted, and are sorted first otherwise.  If a key is given more
+ * than once, the last value given for it is kept.
+ */
+static VALUE rb_trie_build(VALUE self, VALUE source) {
+    VALUE items = rb_Array(source);
+    long size = RARRAY_LEN(items);
+    VALUE keys = rb_ary_new2(size);
+    VALUE values = rb_ary_new2(size);
+    long i, n;
+
+    /* compared unsigned, so that ALLOC_N is never given a negative count */
+    if((size_t)size > TRIE_INDEX_MAX / 2)
+        rb_raise(rb_eArgError, "too many keys");
+
+    for(i = 0; i < size; i++) {
+        VALUE item = RARRAY_PTR(items)[i];
+        VALUE key, value = (VALUE)TRIE_DATA_ERROR;
+
+        if(TYPE(item) == T_ARRAY) {
+            if(RARRAY_LEN(item) < 1 || RARRAY_LEN(item) > 2)
+                rb_raise(rb_eArgError, "expected a key or a [key, value] pair");
+            key = RARRAY_PTR(item)[0];
+            if(RARRAY_LEN(item) == 2)
+                value = RARRAY_PTR(item)[1];
+        } else {
+            key = item;
+        }
+        rb_ary_push(keys, key_codes(key));
+        rb_ary_push(values, value);
+    }
+
+    BuildEntry *entries = ALLOC_N(BuildEntry, (size_t)size);
+    int sorted = 1;
+    for(i = 0; i < size; i++) {
+        entries[i].key = (const TrieChar *)RSTRING_PTR(RARRAY_PTR(keys)[i]);
+        entries[i].data = (TrieData)RARRAY_PTR(values)[i];
+        entries[i].order = i;
+        if(i > 0 && strcmp((const char *)entries[i - 1].key, (const char *)entries[i].key) > 0)
+            sorted = 0;
+    }
+    if(!sorted)
+        qsort(entries, size, sizeof(BuildEntry), build_entry_cmp);
+
+    /* drop all but the last of repeated keys */
+    const TrieChar **key_ptrs = ALLOC_N(const TrieChar *, (size_t)size);
+    TrieData *data = ALLOC_N(TrieData, (size_t)size);
+    for(i = 0, n = 0; i < size; i++) {
+        if(i + 1 < size && strcmp((const char *)entries[i].key, (const char *)entries[i + 1].key) == 0)
+            continue;
+        key_ptrs[n] = entries[i].key;
+        data[n++] = entries[i].data;
+    }
+
+    Trie *trie = trie_build(key_ptrs, data, (TrieIndex)n);
+    xfree(entries);
+    xfree(key_ptrs);
+    xfree(data);
+    RB_GC_GUARD(keys);
+    RB_GC_GUARD(values);
+
+    if(!trie)
+        rb_raise(rb_eNoMemError, "failed to build trie");
+    return Data_Wrap_Struct(self, 0, trie_free, trie);
+}
+
 /*
  * call-seq:
  *   has_key?(key) -> true/false
@@ -81,7 +285,7 @@ static VALUE rb_trie_has_key(VALUE self, VALUE key) {
     Trie *trie;
     Data_Get_Struct(self, Trie, trie);
 
-    if(trie_has_key(trie, (TrieChar*)RSTRING_PTR(key)))
+    if(trie_has_key_len(trie, (TrieChar*)RSTRING_PTR(key), RSTRING_LEN(key)))
 		return Qtrue;
     else
 		return Qnil;
@@ -102,12 +306,340 @@ static VALUE rb_trie_get(VALUE self, VALUE key) {
     Data_Get_Struct(self, Trie, trie);
 
 	TrieData data;
-    if(trie_retrieve(trie, (TrieChar*)RSTRING_PTR(key), &data))
+    if(trie_retrieve_len(trie, (TrieChar*)RSTRING_PTR(key), RSTRING_LEN(key), &data))
 		return (VALUE)data;
     else
 		return Qnil;
 }
 
+/* Looks up all of keys in one call, giving each key's value, or true if values is not set, or nil. */
+static VALUE retrieve_many(VALUE self, VALUE keys, int values) {
+    Check_Type(keys, T_ARRAY);
+
+    Trie *trie;
+    Data_Get_Struct(self, Trie, trie);
+
+    long i, n = RARRAY_LEN(keys);
+    VALUE strs = rb_ary_new2(n);
+    for(i = 0; i < n; i++) {
+        VALUE key = RARRAY_PTR(keys)[i];
+        StringValue(key);
+        rb_ary_push(strs, key);
+    }
+
+    const TrieChar **ptrs = ALLOC_N(const TrieChar *, n);
+    size_t *lens = ALLOC_N(size_t, n);
+    TrieData *data = ALLOC_N(TrieData, n);
+    Bool *found = ALLOC_N(Bool, n);
+    for(i = 0; i < n; i++) {
+        ptrs[i] = (const TrieChar*)RSTRING_PTR(RARRAY_PTR(strs)[i]);
+        lens[i] = RSTRING_LEN(RARRAY_PTR(strs)[i]);
+    }
+
+    trie_retrieve_many(trie, ptrs, lens, n, values ? data : NULL, found);
+
+    VALUE result = rb_ary_new2(n);
+    for(i = 0; i < n; i++)
+        rb_ary_push(result, !found[i] ? Qnil : values ? (VALUE)data[i] : Qtrue);
+
+    xfree(ptrs);
+    xfree(lens);
+    xfree(data);
+    xfree(found);
+    RB_GC_GUARD(strs);
+    return result;
+}
+
+/*
+ * call-seq:
+ *   get_many(keys) -> [ value, ... ]
+ *
+ * Retrieves the values for an Array of keys (or nil for each key not in the Trie) in one call.  The
+ * lookups of several keys are interleaved, so that their waits on memory overlap, which makes this
+ * faster than calling Trie#get for each key.
+ *
+ */
+static VALUE rb_trie_get_many(VALUE self, VALUE keys) {
+    return retrieve_many(self, keys, 1);
+}
+
+/*
+ * call-seq:
+ *   has_keys?(keys) -> [ true/nil, ... ]
+ *
+ * Determines for each of an Array of keys whether it exists in the Trie, in one call like Trie#get_many.
+ *
+ */
+static VALUE rb_trie_has_keys(VALUE self, VALUE keys) {
+    return retrieve_many(self, keys, 0);
+}
+
+/*
+ * call-seq:
+ *   longest_prefix(string) -> [key, value]
+ *
+ * Finds the longest key in the Trie that string begins with, and returns it with its value, or nil if
+ * no key is a prefix of string.  The walk along string is made in one call, without allocating a
+ * TrieNode for each character.
+ *
+ */
+static VALUE rb_trie_longest_prefix(VALUE self, VALUE str) {
+    StringValue(str);
+
+    Trie *trie;
+    Data_Get_Struct(self, Trie, trie);
+
+    size_t len;
+    TrieData data;
+    if(!trie_longest_prefix(trie, (TrieChar*)RSTRING_PTR(str), RSTRING_LEN(str), &len, &data))
+        return Qnil;
+    return rb_assoc_new(rb_str_new(RSTRING_PTR(str), len), (VALUE)data);
+}
+
+typedef struct {
+    Trie *trie;
+    VALUE str;
+    long offset;
+    VALUE result;
+} PrefixesOf;
+
+static Bool yield_prefix(size_t len, TrieData data, void *user_data) {
+    PrefixesOf *prefixes = (PrefixesOf *)user_data;
+    VALUE key = rb_str_new(RSTRING_PTR(prefixes->str) + prefixes->offset, len);
+    VALUE end = LONG2NUM(prefixes->offset + (long)len);
+
+    if(NIL_P(prefixes->result))
+        rb_yield_values(3, key, (VALUE)data, end);
+    else
+        rb_ary_push(prefixes->result, rb_ary_new3(3, key, (VALUE)data, end));
+    return TRUE;
+}
+
+static VALUE walk_prefixes(VALUE arg) {
+    PrefixesOf *prefixes = (PrefixesOf *)arg;
+    trie_walk_prefixes(prefixes->trie, (TrieChar*)RSTRING_PTR(prefixes->str) + prefixes->offset,
+                       RSTRING_LEN(prefixes->str) - prefixes->offset, yield_prefix, prefixes);
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   prefixes_of(string, offset = 0) -> [ [key, value, end], ... ]
+ *   prefixes_of(string, offset = 0) { |key, value, end| ... }
+ *
+ * Finds every key in the Trie that is a prefix of string from the byte offset on, shortest first,
+ * each with its value and the byte offset in string at which it ends.  The keys are found in one walk
+ * along string.  With a block, each is yielded in turn instead of being gathered into an Array.
+ *
+ */
+static VALUE rb_trie_prefixes_of(int argc, VALUE *argv, VALUE self) {
+    VALUE str, offset;
+    rb_scan_args(argc, argv, "11", &str, &offset);
+    StringValue(str);
+
+    long start = NIL_P(offset) ? 0 : NUM2LONG(offset);
+    if(start < 0 || start > RSTRING_LEN(str))
+        rb_raise(rb_eIndexError, "offset %ld out of string", start);
+
+    Trie *trie;
+    Data_Get_Struct(self, Trie, trie);
+
+    /* the block may change the string, but not the bytes being walked */
+    PrefixesOf prefixes;
+    prefixes.trie = trie;
+    prefixes.str = rb_str_new_frozen(str);
+    prefixes.offset = start;
+    prefixes.result = rb_block_given_p() ? Qnil : rb_ary_new();
+
+    if(NIL_P(prefixes.result))
+        guard_walk(self, walk_prefixes, (VALUE)&prefixes);
+    else
+        walk_prefixes((VALUE)&prefixes);
+    RB_GC_GUARD(prefixes.str);
+
+    return NIL_P(prefixes.result) ? self : prefixes.result;
+}
+
+static Bool push_fuzzy_match(const TrieChar *key, size_t len, int distance, TrieData data, void *user_data) {
+    VALUE by_distance = (VALUE)user_data;
+    VALUE matches = rb_ary_entry(by_distance, distance);
+    if(NIL_P(matches)) {
+        matches = rb_ary_new();
+        rb_ary_store(by_distance, distance, matches);
+    }
+    rb_ary_push(matches, rb_ary_new3(3, rb_str_new((const char *)key, len), INT2FIX(distance), (VALUE)data));
+    return TRUE;
+}
+
+/*
+ * call-seq:
+ *   fuzzy(word, max_distance) -> [ [key, distance, value], ... ]
+ *   fuzzy(word, max_distance, :limit => n) -> [ [key, distance, value], ... ]
+ *
+ * Finds the keys within max_distance edits of word, an edit being the insertion, deletion or
+ * substitution of a byte, and returns each with its distance and value.  The nearest keys come first,
+ * and keys as near in key order.  With :limit, only the first n are returned.  The search walks the
+ * Trie depth first, and leaves any branch as soon as no key along it can be near enough.  With
+ * :limit, it looks for nearer keys first, and does not look further once it has found enough.
+ *
+ */
+static VALUE rb_trie_fuzzy(int argc, VALUE *argv, VALUE self) {
+    VALUE word, max_distance, opts;
+    rb_scan_args(argc, argv, "21", &word, &max_distance, &opts);
+    StringValue(word);
+
+    int max = NUM2INT(max_distance);
+    long limit = -1;
+    if(!NIL_P(opts)) {
+        Check_Type(opts, T_HASH);
+        VALUE rlimit = rb_hash_aref(opts, ID2SYM(rb_intern("limit")));
+        if(!NIL_P(rlimit))
+            limit = NUM2LONG(rlimit);
+    }
+    if(max < 0 || limit == 0)
+        return rb_ary_new();
+
+    Trie *trie;
+    Data_Get_Struct(self, Trie, trie);
+
+    /* with a limit, widen the bound one edit at a time, as the nearest keys may be enough and are
+     * much cheaper to find */
+    VALUE result = rb_ary_new();
+    int bound = limit > 0 ? 0 : max;
+    for(; bound <= max; bound++) {
+        VALUE by_distance = rb_ary_new();
+        if(!trie_fuzzy(trie, (TrieChar*)RSTRING_PTR(word), RSTRING_LEN(word), bound, push_fuzzy_match, (void*)by_distance))
+            rb_raise(rb_eNoMemError, "failed to search trie");
+
+        long d;
+        for(d = limit > 0 ? bound : 0; d < RARRAY_LEN(by_distance); d++) {
+            VALUE matches = RARRAY_PTR(by_distance)[d];
+            if(!NIL_P(matches))
+                rb_ary_concat(result, matches);
+        }
+        if(limit > 0 && RARRAY_LEN(result) >= limit)
+            break;
+    }
+    if(limit > 0 && RARRAY_LEN(result) > limit)
+        rb_ary_resize(result, limit);
+    return result;
+}
+
+typedef struct {
+    Trie *trie;
+    TriePattern *pattern;
+    TrieIterator *it;
+    VALUE result;
+} Match;
+
+static VALUE walk_match(VALUE arg) {
+    Match *match = (Match *)arg;
+    const TrieChar *key;
+    size_t len;
+    TrieData data;
+
+    while(trie_iterator_next(match->it, &key, &len, &data)) {
+        VALUE rkey = rb_str_new((const char *)key, len);
+        if(NIL_P(match->result))
+            rb_yield_values(2, rkey, (VALUE)data);
+        else
+            rb_ary_push(match->result, rkey);
+    }
+    if(trie_iterator_failed(match->it))
+        rb_raise(rb_eNoMemError, "failed to search trie");
+    return Qnil;
+}
+
+/* Frees the walk however it ends, a break or raise from the block included. */
+static VALUE end_match(VALUE arg) {
+    Match *match = (Match *)arg;
+    trie_iterator_free(match->it);
+    trie_pattern_free(match->pattern);
+    if(NIL_P(match->result))
+        match->trie->num_walks--;
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   match(pattern) -> [ key, ... ]
+ *   match(pattern) { |key, value| ... }
+ *
+ * Finds the keys matching a wildcard pattern, in which <tt>?</tt> stands for any byte, <tt>*</tt> for
+ * any run of bytes, <tt>[abc]</tt> or <tt>[a-z]</tt> for any byte of a class, <tt>[^abc]</tt> for any
+ * byte out of one, and <tt>\</tt> makes the next byte stand for itself.  Only the branches of the
+ * Trie that can still match are walked.  With a block, each key is yielded with its value as it is
+ * found instead of being gathered into an Array; the Trie can not be changed from the block.
+ *
+ */
+static VALUE rb_trie_match(VALUE self, VALUE pattern) {
+    StringValue(pattern);
+
+    Trie *trie;
+    Data_Get_Struct(self, Trie, trie);
+
+    Match match;
+    match.trie = trie;
+    match.result = rb_block_given_p() ? Qnil : rb_ary_new();
+    match.pattern = trie_pattern_new((TrieChar*)RSTRING_PTR(pattern), RSTRING_LEN(pattern));
+    if(!match.pattern)
+        rb_raise(rb_eArgError, "unclosed character class in pattern");
+    match.it = trie_iterator_new_match(trie, match.pattern);
+    if(!match.it) {
+        trie_pattern_free(match.pattern);
+        rb_raise(rb_eNoMemError, "failed to search trie");
+    }
+
+    /* a block walk is counted as guard_walk does */
+    if(NIL_P(match.result))
+        trie->num_walks++;
+    rb_ensure(walk_match, (VALUE)&match, end_match, (VALUE)&match);
+    return NIL_P(match.result) ? self : match.result;
+}
+
+/* Keys rank by their Integer values; keys with other values are not ranked. */
+static int64_t value_weight(TrieData data) {
+    VALUE value = (VALUE)data;
+    if((TrieData)TRIE_DATA_ERROR == data || !FIXNUM_P(value))
+        return TRIE_WEIGHT_NONE;
+    return FIX2LONG(value);
+}
+
+static Bool push_ranked_key(const TrieChar *key, size_t len, TrieData data, void *user_data) {
+    rb_ary_push((VALUE)user_data, rb_assoc_new(rb_str_new((const char *)key, len), (VALUE)data));
+    return TRUE;
+}
+
+/*
+ * call-seq:
+ *   top_k(prefix, k) -> [ [key, value], ... ]
+ *
+ * Finds the k keys starting with prefix that have the largest Integer values, largest first.  Keys
+ * with values that are not Integers are left out, and keys with equal values come in no particular
+ * order.  The first call has every node of the Trie note the largest value below it, which the Trie
+ * then keeps up to date as keys are added and deleted.  The search is best first and only expands the
+ * branches leading to the keys found, so it costs about as much for a prefix with millions of keys
+ * below it as for one with a handful.
+ *
+ */
+static VALUE rb_trie_top_k(VALUE self, VALUE prefix, VALUE k) {
+    StringValue(prefix);
+    long count = NUM2LONG(k);
+    if(count < 0)
+        rb_raise(rb_eArgError, "negative k");
+
+    Trie *trie;
+    Data_Get_Struct(self, Trie, trie);
+
+    if(!trie->weigh && !trie_keep_weights(trie, value_weight))
+        rb_raise(rb_eNoMemError, "failed to weigh trie");
+
+    VALUE result = rb_ary_new();
+    if(!trie_top_k(trie, (TrieChar*)RSTRING_PTR(prefix), RSTRING_LEN(prefix), (size_t)count, push_ranked_key, (void*)result))
+        rb_raise(rb_eNoMemError, "failed to search trie");
+    return result;
+}
+
 /*
  * call-seq:
  *   add(key)
@@ -119,6 +651,7 @@ static VALUE rb_trie_get(VALUE self, VALUE key) {
 static VALUE rb_trie_add(VALUE self, VALUE args) {
 	Trie *trie;
     Data_Get_Struct(self, Trie, trie);
+    check_unwalked(trie);
 
     int size = RARRAY_LEN(args);
     if(size < 1 || size > 2)
@@ -130,12 +663,109 @@ static VALUE rb_trie_add(VALUE self, VALUE args) {
 
     TrieData value = size == 2 ? RARRAY_PTR(args)[1] : TRIE_DATA_ERROR;
     
-    if(trie_store(trie, (TrieChar*)RSTRING_PTR(key), value))
+    if(trie_store_len(trie, (TrieChar*)RSTRING_PTR(key), RSTRING_LEN(key), value))
 		return Qtrue;
     else
 		return Qnil;
 }
 
+typedef struct {
+    const TrieChar *key;
+    size_t          len;
+    TrieData        data;
+    long            order;
+} AddEntry;
+
+static int add_entry_cmp(const void *a, const void *b) {
+    const AddEntry *x = (const AddEntry *)a, *y = (const AddEntry *)b;
+    int cmp = memcmp(x->key, y->key, x->len < y->len ? x->len : y->len);
+    if(cmp != 0)
+        return cmp;
+    if(x->len != y->len)
+        return x->len < y->len ? -1 : 1;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/*
+ * call-seq:
+ *   add_all(keys)
+ *   add_all([ [key,value], ... ])
+ *   add_all(hash)
+ *
+ * Adds many keys, or keys and values, to the Trie, taking them as Trie.build does.  Each key is walked
+ * from where it parts from the key added before it, rather than from the root, so this is faster than
+ * calling Trie#add for each key, most of all when merging a sorted list into a large Trie.  Keys are
+ * sorted first if they are not already.  If a key is given more than once, the last value given for it
+ * is kept.  Returns true, or nil if some key could not be added.
+ *
+ */
+static VALUE rb_trie_add_all(VALUE self, VALUE source) {
+    Trie *trie;
+    Data_Get_Struct(self, Trie, trie);
+    check_unwalked(trie);
+
+    VALUE items = rb_Array(source);
+    long size = RARRAY_LEN(items);
+    VALUE keys = rb_ary_new2(size);
+    VALUE values = rb_ary_new2(size);
+    long i;
+
+    /* as in Trie.build, so that ALLOC_N is never given a negative count */
+    if((size_t)size > TRIE_INDEX_MAX / 2)
+        rb_raise(rb_eArgError, "too many keys");
+
+    for(i = 0; i < size; i++) {
+        VALUE item = RARRAY_PTR(items)[i];
+        VALUE key, value = (VALUE)TRIE_DATA_ERROR;
+
+        if(TYPE(item) == T_ARRAY) {
+            if(RARRAY_LEN(item) < 1 || RARRAY_LEN(item) > 2)
+                rb_raise(rb_eArgError, "expected a key or a [key, value] pair");
+            key = RARRAY_PTR(item)[0];
+            if(RARRAY_LEN(item) == 2)
+                value = RARRAY_PTR(item)[1];
+        } else {
+            key = item;
+        }
+        StringValue(key);
+        rb_ary_push(keys, key);
+        rb_ary_push(values, value);
+    }
+
+    AddEntry *entries = ALLOC_N(AddEntry, (size_t)size);
+    int sorted = 1;
+    for(i = 0; i < size; i++) {
+        VALUE key = RARRAY_PTR(keys)[i];
+        entries[i].key = (const TrieChar *)RSTRING_PTR(key);
+        entries[i].len = RSTRING_LEN(key);
+        entries[i].data = (TrieData)RARRAY_PTR(values)[i];
+        entries[i].order = i;
+        if(i > 0 && add_entry_cmp(&entries[i - 1], &entries[i]) > 0)
+            sorted = 0;
+    }
+    if(!sorted)
+        qsort(entries, size, sizeof(AddEntry), add_entry_cmp);
+
+    const TrieChar **key_ptrs = ALLOC_N(const TrieChar *, (size_t)size);
+    size_t *lens = ALLOC_N(size_t, (size_t)size);
+    TrieData *data = ALLOC_N(TrieData, (size_t)size);
+    for(i = 0; i < size; i++) {
+        key_ptrs[i] = entries[i].key;
+        lens[i] = entries[i].len;
+        data[i] = entries[i].data;
+    }
+
+    Bool ok = trie_store_many(trie, key_ptrs, lens, data, size);
+    xfree(entries);
+    xfree(key_ptrs);
+    xfree(lens);
+    xfree(data);
+    RB_GC_GUARD(keys);
+    RB_GC_GUARD(values);
+
+    return ok ? Qtrue : Qnil;
+}
+
 /*
  * call-seq:
  *   delete(key)
@@ -148,58 +778,251 @@ static VALUE rb_trie_delete(VALUE self, VALUE key) {
 
 	Trie *trie;
     Data_Get_Struct(self, Trie, trie);
+    check_unwalked(trie);
 
-    if(trie_delete(trie, (TrieChar*)RSTRING_PTR(key)))
+    if(trie_delete_len(trie, (TrieChar*)RSTRING_PTR(key), RSTRING_LEN(key)))
 		return Qtrue;
     else
 		return Qnil;
 }
 
-static VALUE walk_all_paths(Trie *trie, VALUE children, TrieState *state, char *prefix, int prefix_size) {
-	int c;
-    for(c = 1; c < 256; c++) {
-		if(trie_state_is_walkable(state,c)) {
-			TrieState *next_state = trie_state_clone(state);
-			trie_state_walk(next_state, c);
+/*
+ * call-seq:
+ *   increment(key)     -> integer
+ *   increment(key, by) -> integer
+ *
+ * Adds by (or 1) to the integer value of a key and returns the sum.  A key not yet in the Trie is
+ * added with by as its value.  The key is found or added in a single walk of the Trie, which makes
+ * this faster than a get followed by an add for counting.  Returns nil if the key can not be added.
+ *
+ */
+static VALUE rb_trie_increment(int argc, VALUE *argv, VALUE self) {
+    VALUE key, by;
+    rb_scan_args(argc, argv, "11", &key, &by);
+    StringValue(key);
 
-			prefix[prefix_size] = c;
-			prefix[prefix_size + 1] = 0;
+    long step = NIL_P(by) ? 1 : NUM2LONG(by);
+    if(!FIXABLE(step))
+        rb_raise(rb_eRangeError, "increment out of range");
 
-			if(trie_state_is_terminal(next_state)) {
-				char *word = (char*) malloc(prefix_size + 2);
-				memcpy(word, prefix, prefix_size + 2);
-				rb_ary_push(children, rb_str_new2(word));
+    Trie *trie;
+    Data_Get_Struct(self, Trie, trie);
+    check_unwalked(trie);
+
+    Bool stored;
+    TrieData *slot = trie_fetch_or_store(trie, (TrieChar*)RSTRING_PTR(key), RSTRING_LEN(key),
+                                         (TrieData)LONG2FIX(step), &stored);
+    if(!slot)
+        return Qnil;
+
+    if(!stored) {
+        VALUE value = (VALUE)*slot;
+        if(!FIXNUM_P(value))
+            rb_raise(rb_eTypeError, "value of key is not an Integer");
+        long sum = FIX2LONG(value) + step;
+        if(!FIXABLE(sum))
+            rb_raise(rb_eRangeError, "value of key out of range");
+        *slot = (TrieData)LONG2FIX(sum);
+        trie_reweigh_len(trie, (TrieChar*)RSTRING_PTR(key), RSTRING_LEN(key));
+    }
+    return (VALUE)*slot;
+}
+
+/*
+ * call-seq:
+ *   fetch_or_store(key, default = nil)      -> value
+ *   fetch_or_store(key) { |key| block }     -> value
+ *
+ * Returns the value of a key, first adding the key with the default, or the result of the block,
+ * if it is not in the Trie yet.  Without a block, the key is found or added in a single walk of the
+ * Trie.  Returns nil if the key can not be added.
+ *
+ */
+static VALUE rb_trie_fetch_or_store(int argc, VALUE *argv, VALUE self) {
+    VALUE key, value;
+    rb_scan_args(argc, argv, "11", &key, &value);
+    StringValue(key);
+
+    Trie *trie;
+    Data_Get_Struct(self, Trie, trie);
+    check_unwalked(trie);
+
+    /* the block may change the trie, so it is only called between walks */
+    if(rb_block_given_p()) {
+        TrieData data;
+        if(trie_retrieve_len(trie, (TrieChar*)RSTRING_PTR(key), RSTRING_LEN(key), &data))
+            return (VALUE)data;
+        value = rb_yield(key);
+        StringValue(key);
+        if(!trie_store_len(trie, (TrieChar*)RSTRING_PTR(key), RSTRING_LEN(key), value))
+            return Qnil;
+        return value;
+    }
+
+    Bool stored;
+    TrieData *slot = trie_fetch_or_store(trie, (TrieChar*)RSTRING_PTR(key), RSTRING_LEN(key),
+                                         (TrieData)value, &stored);
+    return slot ? (VALUE)*slot : Qnil;
+}
+
+typedef struct {
+	TrieState *state;
+	long prefix_size;
+	int i, n;
+	TrieChar chars[256];
+} WalkFrame;
+
+/* Sets the last of size characters in prefix, doubling it as needed.  The walk keeps its own count of
+ * the characters in use, so that prefix may run longer. */
+static void prefix_put(VALUE prefix, long size, TrieChar c) {
+	if(RSTRING_LEN(prefix) < size)
+		rb_str_resize(prefix, 2 * size);
+	RSTRING_PTR(prefix)[size - 1] = c;
+}
+
+static void walk_frame_init(WalkFrame *frame, TrieState *state, long prefix_size) {
+	frame->state = state;
+	frame->prefix_size = prefix_size;
+	frame->i = 0;
+	frame->n = trie_state_walkable_chars(state, frame->chars, 256);
+}
+
+static void walk_found(Trie *trie, VALUE children, TrieState *state, VALUE prefix, long prefix_size, int with_values) {
+	VALUE key = key_string(trie, prefix, prefix_size);
+	if(!with_values) {
+		rb_ary_push(children, key);
+		return;
+	}
+
+	TrieState *end_state = trie_state_clone(state);
+	trie_state_walk(end_state, '\0');
+
+	VALUE tuple = rb_ary_new();
+	rb_ary_push(tuple, key);
+	rb_ary_push(tuple, (VALUE)trie_state_get_data(end_state));
+	rb_ary_push(children, tuple);
+
+	trie_state_free(end_state);
+}
+
+/*
+ * Walks every path below state, pushing the keys found onto children, with their values if with_values
+ * is set.  prefix holds the characters walked to state.  If children is nil, stops at the first key
+ * found instead and returns TRUE.  The walk keeps its own stack, and follows a suffix in a loop, so
+ * that long keys do not run out of C stack.
+ */
+static Bool walk_all_paths(Trie *trie, VALUE children, TrieState *state, VALUE prefix, long prefix_size, int with_values) {
+	long depth = 0, capa = 16;
+	WalkFrame *stack = ALLOC_N(WalkFrame, capa);
+	Bool found = FALSE;
+
+	walk_frame_init(&stack[0], state, prefix_size);
+	while(depth >= 0 && !found) {
+		WalkFrame *frame = &stack[depth];
+		if(frame->i == frame->n) {
+			if(depth > 0)
+				trie_state_free(frame->state);
+			depth--;
+			continue;
+		}
+
+		TrieChar c = frame->chars[frame->i++];
+		if(c == TRIE_CHAR_TERM)
+			continue;
+
+		TrieState *next_state = trie_state_clone(frame->state);
+		trie_state_walk(next_state, c);
+		long size = frame->prefix_size + 1;
+		prefix_put(prefix, size, c);
+
+		/* a suffix leads to a single key */
+		if(next_state->is_suffix) {
+			while(!trie_state_is_terminal(next_state)) {
+				trie_state_walkable_chars(next_state, &c, 1);
+				trie_state_walk(next_state, c);
+				prefix_put(prefix, ++size, c);
 			}
+		}
+
+		if(trie_state_is_terminal(next_state)) {
+			if(NIL_P(children))
+				found = TRUE;
+			else
+				walk_found(trie, children, next_state, prefix, size, with_values);
+		}
 
-			walk_all_paths(trie, children, next_state, prefix, prefix_size + 1);
-			
-			prefix[prefix_size] = 0;
+		if(next_state->is_suffix) {
 			trie_state_free(next_state);
+			continue;
 		}
+		if(++depth == capa)
+			REALLOC_N(stack, WalkFrame, capa *= 2);
+		walk_frame_init(&stack[depth], next_state, size);
+	}
+
+	for(; depth > 0; depth--)
+		trie_state_free(stack[depth].state);
+	xfree(stack);
+	return found;
+}
+
+
+typedef struct {
+    Trie *trie;
+    TrieIterator *it;
+    long limit;
+    int with_values;
+    VALUE result;       /**< Array to gather the keys in, or nil to yield them */
+} EachKey;
+
+static VALUE walk_each(VALUE arg) {
+    EachKey *each = (EachKey *)arg;
+    const TrieChar *key;
+    size_t len;
+    TrieData data;
+    long n;
+
+    for(n = 0; n != each->limit && trie_iterator_next(each->it, &key, &len, &data); n++) {
+        VALUE rkey = rb_str_new((const char *)key, len);
+        if(!NIL_P(each->result))
+            rb_ary_push(each->result, rkey);
+        else if(each->with_values)
+            rb_yield_values(2, rkey, (VALUE)data);
+        else
+            rb_yield(rkey);
     }
+    if(trie_iterator_failed(each->it))
+        rb_raise(rb_eNoMemError, "failed to walk trie");
+    return Qnil;
 }
 
+static VALUE end_each(VALUE arg) {
+    EachKey *each = (EachKey *)arg;
+    trie_iterator_free(each->it);
+    each->trie->num_walks--;
+    return Qnil;
+}
 
-static Bool traverse(TrieState *state, TrieChar *char_prefix) {
-	const TrieChar *iterator = char_prefix;
-	while(*iterator != 0) {
-		if(!trie_state_is_walkable(state, *iterator))
-			return FALSE;
-		trie_state_walk(state, *iterator);
-		iterator++;
-	}
-	return TRUE;
+static Bool traverse(TrieState *state, VALUE prefix) {
+	return trie_state_walk_key(state, (TrieChar*)RSTRING_PTR(prefix), RSTRING_LEN(prefix));
 }
 
 
 /*
  * call-seq:
  *   children(prefix) -> [ key, ... ]
+ *   children(prefix, :after => key, :limit => n) -> [ key, ... ]
  *
- * Finds all keys in the Trie beginning with the given prefix. 
+ * Finds all keys in the Trie beginning with the given prefix, in key order.  To page through them,
+ * pass the last key of the previous page as :after and the page size as :limit.  The walk then starts
+ * straight from the first key above :after, so that each page costs about as much as the keys on it,
+ * however far into the keys it is.
  *
  */
-static VALUE rb_trie_children(VALUE self, VALUE prefix) {
+static VALUE rb_trie_children(int argc, VALUE *argv, VALUE self) {
+    VALUE prefix, opts;
+    rb_scan_args(argc, argv, "11", &prefix, &opts);
+
     if(NIL_P(prefix))
 		return rb_ary_new();
 
@@ -208,57 +1031,52 @@ static VALUE rb_trie_children(VALUE self, VALUE prefix) {
     Trie *trie;
     Data_Get_Struct(self, Trie, trie);
 
-	int prefix_size = RSTRING_LEN(prefix);
+    VALUE after = Qnil, rlimit = Qnil;
+    if(!NIL_P(opts)) {
+        Check_Type(opts, T_HASH);
+        after = rb_hash_aref(opts, ID2SYM(rb_intern("after")));
+        rlimit = rb_hash_aref(opts, ID2SYM(rb_intern("limit")));
+    }
+    if(!NIL_P(after) || !NIL_P(rlimit)) {
+        EachKey each;
+        each.trie = trie;
+        each.limit = NIL_P(rlimit) ? -1 : NUM2LONG(rlimit);
+        if(!NIL_P(rlimit) && each.limit < 0)
+            rb_raise(rb_eArgError, "negative limit");
+        if(!NIL_P(after))
+            StringValue(after);
+        each.with_values = 0;
+        each.result = rb_ary_new();
+        each.it = trie_iterator_new(trie, (TrieChar*)RSTRING_PTR(prefix), RSTRING_LEN(prefix));
+        if(!each.it)
+            rb_raise(rb_eNoMemError, "failed to walk trie");
+        if(!NIL_P(after))
+            trie_iterator_seek(each.it, (TrieChar*)RSTRING_PTR(after), RSTRING_LEN(after));
+
+        /* end_each frees the walk and ends it as for each_key */
+        trie->num_walks++;
+        rb_ensure(walk_each, (VALUE)&each, end_each, (VALUE)&each);
+        return each.result;
+    }
+
     TrieState *state = trie_root(trie);
     VALUE children = rb_ary_new();
-	TrieChar *char_prefix = (TrieChar*)RSTRING_PTR(prefix);
     
-    if(!traverse(state, char_prefix)) {
+    if(!traverse(state, prefix)) {
+		trie_state_free(state);
     	return children;
     }
 
     if(trie_state_is_terminal(state))
 		rb_ary_push(children, prefix);
 	
-	char prefix_buffer[1024];
-	memcpy(prefix_buffer, char_prefix, prefix_size);
-	prefix_buffer[prefix_size] = 0;
-
-    walk_all_paths(trie, children, state, prefix_buffer, prefix_size);
+	VALUE buffer = prefix_buffer(trie, prefix);
+    walk_all_paths(trie, children, state, buffer, RSTRING_LEN(buffer), 0);
 
     trie_state_free(state);
     return children;
 }
 
-static Bool walk_all_paths_until_first_terminal(Trie *trie, TrieState *state, char *prefix, int prefix_size) {
-	int c;
-	Bool ret = FALSE;
-    for(c = 1; c < 256; c++) {
-		if(trie_state_is_walkable(state,c)) {
-			TrieState *next_state = trie_state_clone(state);
-			trie_state_walk(next_state, c);
-
-			prefix[prefix_size] = c;
-			prefix[prefix_size + 1] = 0;
-
-			if(trie_state_is_terminal(next_state)) {
-				return TRUE;
-			}
-
-			ret = walk_all_paths_until_first_terminal(trie, next_state, prefix, prefix_size + 1);
-
-			prefix[prefix_size] = 0;
-			trie_state_free(next_state);
-
-			if (ret == TRUE) {
-				return ret;
-			}
-		}
-    }
-
-    return ret;
-}
-
 static VALUE rb_trie_has_children(VALUE self, VALUE prefix) {
     if(NIL_P(prefix))
 		return rb_ary_new();
@@ -268,62 +1086,24 @@ static VALUE rb_trie_has_children(VALUE self, VALUE prefix) {
     Trie *trie;
     Data_Get_Struct(self, Trie, trie);
 
-	int prefix_size = RSTRING_LEN(prefix);
     TrieState *state = trie_root(trie);
-	TrieChar *char_prefix = (TrieChar*)RSTRING_PTR(prefix);
 
-    if(!traverse(state, char_prefix)) {
+    if(!traverse(state, prefix)) {
+		trie_state_free(state);
 		return Qfalse;
 	}
 
-    if(trie_state_is_terminal(state))
+    if(trie_state_is_terminal(state)) {
+		trie_state_free(state);
         return Qtrue;
+	}
 
-	char prefix_buffer[1024];
-	memcpy(prefix_buffer, char_prefix, prefix_size);
-	prefix_buffer[prefix_size] = 0;
-
-    Bool ret = walk_all_paths_until_first_terminal(trie, state, prefix_buffer, prefix_size);
+    Bool ret = walk_all_paths(trie, Qnil, state, rb_str_new(0, 0), 0, 0);
 
     trie_state_free(state);
     return ret == TRUE ? Qtrue : Qfalse;
 }
 
-static VALUE walk_all_paths_with_values(Trie *trie, VALUE children, TrieState *state, char *prefix, int prefix_size) {
-	int c;
-    for(c = 1; c < 256; c++) {
-		if(trie_state_is_walkable(state,c)) {
-			TrieState *next_state = trie_state_clone(state);
-			trie_state_walk(next_state, c);
-
-			prefix[prefix_size] = c;
-			prefix[prefix_size + 1] = 0;
-
-			if(trie_state_is_terminal(next_state)) {
-				TrieState *end_state = trie_state_clone(next_state);
-				trie_state_walk(end_state, '\0');
- 
-				char *word = (char*) malloc(prefix_size + 2);
-				memcpy(word, prefix, prefix_size + 2);
-
-				VALUE tuple = rb_ary_new();
-				rb_ary_push(tuple, rb_str_new2(word));
-
-				TrieData trie_data = trie_state_get_data(end_state);
-				rb_ary_push(tuple, (VALUE)trie_data);
-				rb_ary_push(children, tuple);
- 
-				trie_state_free(end_state);
-			}
-
-			walk_all_paths_with_values(trie, children, next_state, prefix, prefix_size + 1);
-			
-			prefix[prefix_size] = 0;
-			trie_state_free(next_state);
-		}
-    }
-}
-
 /*
  * call-seq:
  *   children_with_values(key) -> [ [key,value], ... ]
@@ -340,14 +1120,12 @@ static VALUE rb_trie_children_with_values(VALUE self, VALUE prefix) {
     Trie *trie;
     Data_Get_Struct(self, Trie, trie);
 
-	int prefix_size = RSTRING_LEN(prefix);
-    TrieChar *char_prefix = (TrieChar*)RSTRING_PTR(prefix);
-    
     VALUE children = rb_ary_new();
 
     TrieState *state = trie_root(trie);
     
-    if(!traverse(state, char_prefix)) {
+    if(!traverse(state, prefix)) {
+		trie_state_free(state);
 		return children;
 	}
 
@@ -364,16 +1142,94 @@ static VALUE rb_trie_children_with_values(VALUE self, VALUE prefix) {
 		trie_state_free(end_state);
     }
 
-	char prefix_buffer[1024];
-	memcpy(prefix_buffer, char_prefix, prefix_size);
-	prefix_buffer[prefix_size] = 0;
-
-    walk_all_paths_with_values(trie, children, state, prefix_buffer, prefix_size);
+	VALUE buffer = prefix_buffer(trie, prefix);
+    walk_all_paths(trie, children, state, buffer, RSTRING_LEN(buffer), 1);
 
     trie_state_free(state);
     return children;
 }
 
+static VALUE each_key(int argc, VALUE *argv, VALUE self, int with_values) {
+    if(!rb_block_given_p()) {
+#ifdef HAVE_RB_ENUMERATORIZE_WITH_SIZE_KW
+        VALUE enumerator = rb_enumeratorize_with_size_kw(self, ID2SYM(rb_frame_this_func()), argc, argv, 0,
+                                                         rb_keyword_given_p());
+#else
+        VALUE enumerator = rb_enumeratorize(self, ID2SYM(rb_frame_this_func()), argc, argv);
+#endif
+        /* Enumerator#lazy is only there from Ruby 2.0 on */
+        if(!rb_respond_to(enumerator, rb_intern("lazy")))
+            return enumerator;
+        return rb_funcall(enumerator, rb_intern("lazy"), 0);
+    }
+
+    VALUE prefix, opts;
+    rb_scan_args(argc, argv, "02", &prefix, &opts);
+    /* each_key(:limit => n) gives the options alone */
+    if(argc == 1 && TYPE(prefix) == T_HASH) {
+        opts = prefix;
+        prefix = Qnil;
+    }
+    if(NIL_P(prefix))
+        prefix = rb_str_new(0, 0);
+    StringValue(prefix);
+
+    long limit = -1;
+    if(!NIL_P(opts)) {
+        Check_Type(opts, T_HASH);
+        VALUE rlimit = rb_hash_aref(opts, ID2SYM(rb_intern("limit")));
+        if(!NIL_P(rlimit)) {
+            limit = NUM2LONG(rlimit);
+            if(limit < 0)
+                rb_raise(rb_eArgError, "negative limit");
+        }
+    }
+
+    Trie *trie;
+    Data_Get_Struct(self, Trie, trie);
+
+    EachKey each;
+    each.trie = trie;
+    each.it = trie_iterator_new(trie, (TrieChar*)RSTRING_PTR(prefix), RSTRING_LEN(prefix));
+    if(!each.it)
+        rb_raise(rb_eNoMemError, "failed to walk trie");
+    each.limit = limit;
+    each.with_values = with_values;
+    each.result = Qnil;
+
+    /* counted as guard_walk does, with the walk freed along */
+    trie->num_walks++;
+    rb_ensure(walk_each, (VALUE)&each, end_each, (VALUE)&each);
+    return self;
+}
+
+/*
+ * call-seq:
+ *   each_key(prefix = '', :limit => n) { |key| ... } -> self
+ *   each_key(prefix = '', :limit => n)               -> Enumerator::Lazy
+ *
+ * Yields the keys beginning with prefix in key order, at most n of them with :limit.  Keys are found
+ * one at a time as they are yielded, rather than all gathered first as by Trie#children, so breaking
+ * out of the block early leaves the rest of the Trie unwalked.  The Trie can not be changed from the
+ * block.  Without a block, returns a lazy Enumerator over the keys, or a plain one before Ruby 2.0.
+ *
+ */
+static VALUE rb_trie_each_key(int argc, VALUE *argv, VALUE self) {
+    return each_key(argc, argv, self, 0);
+}
+
+/*
+ * call-seq:
+ *   each_pair(prefix = '', :limit => n) { |key, value| ... } -> self
+ *   each_pair(prefix = '', :limit => n)                      -> Enumerator::Lazy
+ *
+ * As Trie#each_key, yielding each key with its value.
+ *
+ */
+static VALUE rb_trie_each_pair(int argc, VALUE *argv, VALUE self) {
+    return each_key(argc, argv, self, 1);
+}
+
 static VALUE rb_trie_node_alloc(VALUE klass);
 
 /*
@@ -464,7 +1320,7 @@ static VALUE rb_trie_node_walk_bang(VALUE self, VALUE rchar) {
     if(RSTRING_LEN(rchar) != 1)
 		return Qnil;
 
-    Bool result = trie_state_walk(state, *RSTRING_PTR(rchar));
+    Bool result = trie_state_walk_key(state, (TrieChar*)RSTRING_PTR(rchar), 1);
     
     if(result) {
 		rb_iv_set(self, "@state", rchar);
@@ -495,7 +1351,7 @@ static VALUE rb_trie_node_walk(VALUE self, VALUE rchar) {
     if(RSTRING_LEN(rchar) != 1)
 		return Qnil;
 
-    Bool result = trie_state_walk(state, *RSTRING_PTR(rchar));
+    Bool result = trie_state_walk_key(state, (TrieChar*)RSTRING_PTR(rchar), 1);
     
     if(result) {
 		rb_iv_set(new_node, "@state", rchar);
@@ -526,7 +1382,7 @@ static VALUE rb_trie_node_value(VALUE self) {
     TrieData trie_data = trie_state_get_data(dup);
     trie_state_free(dup);
 
-    return TRIE_DATA_ERROR == trie_data ? Qnil : (VALUE)trie_data;
+    return (TrieData)TRIE_DATA_ERROR == trie_data ? Qnil : (VALUE)trie_data;
 }
 
 /*
@@ -581,11 +1437,14 @@ static VALUE rb_trie_save(VALUE self, VALUE filename_base) {
     raise_ioerror("Error opening .da file for writing.");
   if (da_write(trie->da, da_file) != 0)
     raise_ioerror("Error writing DArray data.");
+  if (trie->alpha_map && alpha_map_write(trie->alpha_map, da_file) != 0)
+    raise_ioerror("Error writing AlphaMap data.");
   fclose(da_file);
 
   FILE *tail_file = fopen(RSTRING_PTR(tail_filename), "w");
   if (tail_file == NULL)
     raise_ioerror("Error opening .tail file for writing.");
+  tail_pack_suffixes(trie->tail);
   if (tail_write(trie->tail, tail_file) != 0)
     raise_ioerror("Error writing Tail data.");
   fclose(tail_file);
@@ -593,20 +1452,242 @@ static VALUE rb_trie_save(VALUE self, VALUE filename_base) {
   return Qtrue;
 }
 
+/*
+ * call-seq:
+ *   compact! -> self
+ *
+ * Rebuilds the Trie so that it takes as little memory as its keys need,
+ * dropping the space left behind by deleted keys and laying nodes out
+ * breadth-first for faster lookups. TrieNodes taken from the Trie before
+ * compacting must not be used afterwards.
+ */
+static VALUE rb_trie_compact_bang(VALUE self) {
+    Trie *trie;
+    Data_Get_Struct(self, Trie, trie);
+    check_unwalked(trie);
+
+    if (!trie_compact(trie))
+        rb_raise(rb_eNoMemError, "failed to compact trie");
+
+    return self;
+}
+
  
+/*
+ * Document-class: Trie::Scanner
+ *
+ * Finds every occurrence of any of a set of keys in a text, in a single pass over the text, by way of
+ * an Aho-Corasick automaton.  Get one from Trie#scanner.  A Scanner does not change once built, so it
+ * can be shared between threads; the progress of a scan through a text fed in chunks is kept in a
+ * Trie::Scanner::Stream.
+ *
+ */
+
+static void rb_trie_scanner_mark(Scanner *scanner) {
+    size_t i, n = scanner_num_keys(scanner);
+    for(i = 0; i < n; i++)
+        rb_gc_mark((VALUE)scanner_get_data(scanner, i));
+}
+
+/*
+ * call-seq:
+ *   scanner -> Trie::Scanner
+ *
+ * Returns a Trie::Scanner that finds all the keys in the Trie, as they are now, wherever they occur
+ * in a text.
+ *
+ */
+static VALUE rb_trie_scanner(VALUE self) {
+    VALUE pairs = rb_trie_children_with_values(self, rb_str_new(0, 0));
+    long i, n = RARRAY_LEN(pairs);
+
+    const TrieChar **keys = ALLOC_N(const TrieChar *, n);
+    size_t *lens = ALLOC_N(size_t, n);
+    TrieData *data = ALLOC_N(TrieData, n);
+    for(i = 0; i < n; i++) {
+        VALUE pair = RARRAY_PTR(pairs)[i];
+        VALUE key = RARRAY_PTR(pair)[0];
+        keys[i] = (const TrieChar *)RSTRING_PTR(key);
+        lens[i] = RSTRING_LEN(key);
+        data[i] = (TrieData)RARRAY_PTR(pair)[1];
+    }
+
+    Scanner *scanner = scanner_new(keys, lens, data, n);
+    xfree(keys);
+    xfree(lens);
+    xfree(data);
+    RB_GC_GUARD(pairs);
+
+    if(!scanner)
+        rb_raise(rb_eNoMemError, "failed to build scanner");
+    return Data_Wrap_Struct(cTrieScanner, rb_trie_scanner_mark, scanner_free, scanner);
+}
+
+typedef struct {
+    VALUE result;
+} ScanMatches;
+
+static Bool yield_match(size_t start, size_t len, TrieData data, void *user_data) {
+    ScanMatches *matches = (ScanMatches *)user_data;
+    VALUE rstart = SIZET2NUM(start), rlen = SIZET2NUM(len);
+
+    if(NIL_P(matches->result))
+        rb_yield_values(3, rstart, rlen, (VALUE)data);
+    else
+        rb_ary_push(matches->result, rb_ary_new3(3, rstart, rlen, (VALUE)data));
+    return TRUE;
+}
+
+/* Feeds text through the scanner from state, yielding the matches or returning them in an Array. */
+static VALUE scan_text(VALUE scanner_obj, ScannerState *state, VALUE text) {
+    StringValue(text);
+
+    Scanner *scanner;
+    Data_Get_Struct(scanner_obj, Scanner, scanner);
+
+    /* the block may change the text, but not the bytes being scanned */
+    VALUE frozen = rb_str_new_frozen(text);
+    ScanMatches matches;
+    matches.result = rb_block_given_p() ? Qnil : rb_ary_new();
+
+    scanner_scan(scanner, state, (TrieChar*)RSTRING_PTR(frozen), RSTRING_LEN(frozen), yield_match, &matches);
+    RB_GC_GUARD(frozen);
+
+    return matches.result;
+}
+
+/*
+ * call-seq:
+ *   scan(text) -> [ [start, length, value], ... ]
+ *   scan(text) { |start, length, value| ... }
+ *
+ * Finds every occurrence of every key in text, giving the byte offset it starts at, its length in bytes
+ * and the value of the key.  Occurrences are given in the order of their ends, the longest first of
+ * those ending together, and may overlap.  With a block, each is yielded in turn instead of being
+ * gathered into an Array.
+ *
+ */
+static VALUE rb_trie_scanner_scan(VALUE self, VALUE text) {
+    Scanner *scanner;
+    Data_Get_Struct(self, Scanner, scanner);
+
+    ScannerState state;
+    scanner_start(scanner, &state);
+    VALUE result = scan_text(self, &state, text);
+    return NIL_P(result) ? self : result;
+}
+
+typedef struct {
+    VALUE scanner;
+    ScannerState state;
+} ScannerStream;
+
+static void rb_trie_scanner_stream_mark(ScannerStream *stream) {
+    rb_gc_mark(stream->scanner);
+}
+
+/*
+ * call-seq:
+ *   stream -> Trie::Scanner::Stream
+ *
+ * Returns a Trie::Scanner::Stream to scan a text fed to it in chunks.
+ *
+ */
+static VALUE rb_trie_scanner_stream(VALUE self) {
+    Scanner *scanner;
+    Data_Get_Struct(self, Scanner, scanner);
+
+    ScannerStream *stream;
+    VALUE obj = Data_Make_Struct(cTrieScannerStream, ScannerStream, rb_trie_scanner_stream_mark, -1, stream);
+    stream->scanner = self;
+    scanner_start(scanner, &stream->state);
+    return obj;
+}
+
+/*
+ * Document-class: Trie::Scanner::Stream
+ *
+ * The progress of a Trie::Scanner through a text fed in chunks.  Keys spanning chunks are found as
+ * they would be in the whole text, and offsets count from the start of the whole text.
+ *
+ */
+
+/*
+ * call-seq:
+ *   feed(chunk) -> [ [start, length, value], ... ]
+ *   feed(chunk) { |start, length, value| ... }
+ *
+ * Scans the next chunk of the text, giving the occurrences of keys ending in it as Trie::Scanner#scan
+ * does.
+ *
+ */
+static VALUE rb_trie_scanner_stream_feed(VALUE self, VALUE chunk) {
+    ScannerStream *stream;
+    Data_Get_Struct(self, ScannerStream, stream);
+
+    VALUE result = scan_text(stream->scanner, &stream->state, chunk);
+    return NIL_P(result) ? self : result;
+}
+
+/*
+ * call-seq:
+ *   offset -> integer
+ *
+ * Returns the number of bytes fed so far.
+ *
+ */
+static VALUE rb_trie_scanner_stream_offset(VALUE self) {
+    ScannerStream *stream;
+    Data_Get_Struct(self, ScannerStream, stream);
+    return SIZET2NUM(stream->state.offset);
+}
+
+/*
+ * call-seq:
+ *   reset -> self
+ *
+ * Starts the stream over on a new text.
+ *
+ */
+static VALUE rb_trie_scanner_stream_reset(VALUE self) {
+    ScannerStream *stream;
+    Data_Get_Struct(self, ScannerStream, stream);
+
+    Scanner *scanner;
+    Data_Get_Struct(stream->scanner, Scanner, scanner);
+    scanner_start(scanner, &stream->state);
+    return self;
+}
+
 void Init_trie() {
     cTrie = rb_define_class("Trie", rb_cObject);
     rb_define_alloc_func(cTrie, rb_trie_alloc);
+    rb_define_method(cTrie, "initialize", rb_trie_initialize, -1);
     rb_define_module_function(cTrie, "read", rb_trie_read, 1);
+    rb_define_module_function(cTrie, "build", rb_trie_build, 1);
     rb_define_method(cTrie, "has_key?", rb_trie_has_key, 1);
     rb_define_method(cTrie, "get", rb_trie_get, 1);
+    rb_define_method(cTrie, "get_many", rb_trie_get_many, 1);
+    rb_define_method(cTrie, "has_keys?", rb_trie_has_keys, 1);
+    rb_define_method(cTrie, "longest_prefix", rb_trie_longest_prefix, 1);
+    rb_define_method(cTrie, "prefixes_of", rb_trie_prefixes_of, -1);
+    rb_define_method(cTrie, "fuzzy", rb_trie_fuzzy, -1);
+    rb_define_method(cTrie, "match", rb_trie_match, 1);
+    rb_define_method(cTrie, "top_k", rb_trie_top_k, 2);
     rb_define_method(cTrie, "add", rb_trie_add, -2);
+    rb_define_method(cTrie, "add_all", rb_trie_add_all, 1);
     rb_define_method(cTrie, "delete", rb_trie_delete, 1);
-    rb_define_method(cTrie, "children", rb_trie_children, 1);
+    rb_define_method(cTrie, "increment", rb_trie_increment, -1);
+    rb_define_method(cTrie, "fetch_or_store", rb_trie_fetch_or_store, -1);
+    rb_define_method(cTrie, "children", rb_trie_children, -1);
     rb_define_method(cTrie, "children_with_values", rb_trie_children_with_values, 1);
+    rb_define_method(cTrie, "each_key", rb_trie_each_key, -1);
+    rb_define_method(cTrie, "each_pair", rb_trie_each_pair, -1);
     rb_define_method(cTrie, "has_children?", rb_trie_has_children, 1);
     rb_define_method(cTrie, "root", rb_trie_root, 0);
     rb_define_method(cTrie, "save", rb_trie_save, 1);
+    rb_define_method(cTrie, "compact!", rb_trie_compact_bang, 0);
+    rb_define_method(cTrie, "scanner", rb_trie_scanner, 0);
 
     cTrieNode = rb_define_class("TrieNode", rb_cObject);
     rb_define_alloc_func(cTrieNode, rb_trie_node_alloc);
@@ -618,4 +1699,15 @@ void Init_trie() {
     rb_define_method(cTrieNode, "value", rb_trie_node_value, 0);
     rb_define_method(cTrieNode, "terminal?", rb_trie_node_terminal, 0);
     rb_define_method(cTrieNode, "leaf?", rb_trie_node_leaf, 0);
+
+    cTrieScanner = rb_define_class_under(cTrie, "Scanner", rb_cObject);
+    rb_undef_alloc_func(cTrieScanner);
+    rb_define_method(cTrieScanner, "scan", rb_trie_scanner_scan, 1);
+    rb_define_method(cTrieScanner, "stream", rb_trie_scanner_stream, 0);
+
+    cTrieScannerStream = rb_define_class_under(cTrieScanner, "Stream", rb_cObject);
+    rb_undef_alloc_func(cTrieScannerStream);
+    rb_define_method(cTrieScannerStream, "feed", rb_trie_scanner_stream_feed, 1);
+    rb_define_method(cTrieScannerStream, "offset", rb_trie_scanner_stream_offset, 0);
+    rb_define_method(cTrieScannerStream, "reset", rb_trie_scanner_stream_reset, 0);
 }
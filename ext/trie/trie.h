@@ -1,18 +1,46 @@
+#include "alpha-map.h"
 #include "darray.h"
 #include "tail.h"
 
+/* Gives the weight a key is ranked by from its data, or TRIE_WEIGHT_NONE
+ * to leave the key out. */
+typedef int64_t (*TrieWeightFunc) (TrieData data);
+
+#define TRIE_WEIGHT_NONE  DA_WEIGHT_NONE
+
 typedef struct _Trie {
+    AlphaMap   *alpha_map;  /**< key alphabet, NULL for raw bytes */
+    int         num_walks;  /**< walks in progress, during which the trie must not change */
+    TrieWeightFunc weigh;   /**< weight of a key from its data, NULL unless weights are kept */
     DArray     *da;
     Tail       *tail;
 } Trie;
 
+/* A compiled wildcard pattern, private to trie-private.c. */
+typedef struct _TriePattern TriePattern;
+
+/* A walk over keys in key order, private to trie-private.c. */
+typedef struct _TrieIterator TrieIterator;
+
 typedef struct _TrieState {
     const Trie *trie;       /**< the corresponding trie */
     TrieIndex   index;      /**< index in double-array/tail structures */
-    short       suffix_idx; /**< suffix character offset, if in suffix */
+    int         suffix_idx; /**< suffix character offset, if in suffix */
     short       is_suffix;  /**< whether it is currently in suffix part */
 } TrieState;
 
+/* Called with the length and data of each key found along a string;
+ * returns TRUE to go on walking, FALSE to stop. */
+typedef Bool (*TriePrefixFunc) (size_t len, TrieData data, void *user_data);
+
+/* Called with each key found and its data; returns TRUE to go on
+ * searching, FALSE to stop. */
+typedef Bool (*TrieKeyFunc) (const TrieChar *key, size_t len, TrieData data, void *user_data);
+
+/* Called with each key found near a word, its length, its edit distance
+ * and data; returns TRUE to go on searching, FALSE to stop. */
+typedef Bool (*TrieFuzzyFunc) (const TrieChar *key, size_t len, int distance, TrieData data, void *user_data);
+
 
 #define trie_da_is_separate(da,s)      (da_get_base ((da), (s)) < 0)
 #define trie_da_get_tail_index(da,s)   (-da_get_base ((da), (s)))
@@ -22,18 +50,49 @@ typedef struct _TrieState {
 
 Trie* trie_new();
 void trie_free(Trie *trie);
-static Bool trie_branch_in_branch (Trie *trie, TrieIndex sep_node, const TrieChar *suffix, TrieData data);
-static Bool trie_branch_in_tail(Trie *trie, TrieIndex sep_node, const TrieChar *suffix, TrieData data);
+void trie_set_alpha_map (Trie *trie, AlphaMap *alpha_map);
+Bool trie_reserve (Trie *trie, TrieIndex num_keys, size_t avg_key_len);
+Bool trie_compact (Trie *trie);
+Trie * trie_build (const TrieChar *keys[], const TrieData data[], TrieIndex num_keys);
+Bool trie_escape_raw_keys (Trie *trie);
+static TrieIndex trie_branch_in_branch (Trie *trie, TrieIndex sep_node, const TrieChar *suffix, TrieData data);
+static TrieIndex trie_branch_in_tail(Trie *trie, TrieIndex sep_node, const TrieChar *suffix, TrieData data);
 Bool trie_store (Trie *trie, const TrieChar *key, TrieData data);
+Bool trie_has_key (const Trie *trie, const TrieChar *key);
 Bool trie_retrieve (const Trie *trie, const TrieChar *key, TrieData *o_data);
 Bool trie_delete (Trie *trie, const TrieChar *key);
+Bool trie_store_len (Trie *trie, const TrieChar *key, size_t len, TrieData data);
+Bool trie_has_key_len (const Trie *trie, const TrieChar *key, size_t len);
+Bool trie_retrieve_len (const Trie *trie, const TrieChar *key, size_t len, TrieData *o_data);
+Bool trie_delete_len (Trie *trie, const TrieChar *key, size_t len);
+TrieData * trie_fetch_or_store (Trie *trie, const TrieChar *key, size_t len, TrieData data, Bool *o_stored);
+Bool trie_store_many (Trie *trie, const TrieChar *keys[], const size_t lens[], const TrieData data[], size_t num_keys);
+void trie_retrieve_many (const Trie *trie, const TrieChar *keys[], const size_t lens[], size_t num_keys, TrieData o_data[], Bool o_found[]);
+TrieChar * trie_escape_key (const TrieChar *key, size_t len, size_t *o_len);
+size_t trie_unescape_key (TrieChar *key, size_t len);
+Bool trie_walk_prefixes (const Trie *trie, const TrieChar *str, size_t len, TriePrefixFunc func, void *user_data);
+Bool trie_longest_prefix (const Trie *trie, const TrieChar *str, size_t len, size_t *o_len, TrieData *o_data);
+Bool trie_fuzzy (const Trie *trie, const TrieChar *word, size_t len, int max_dist, TrieFuzzyFunc func, void *user_data);
+TriePattern * trie_pattern_new (const TrieChar *pattern, size_t len);
+void trie_pattern_free (TriePattern *pattern);
+TrieIterator * trie_iterator_new (const Trie *trie, const TrieChar *prefix, size_t len);
+TrieIterator * trie_iterator_new_match (const Trie *trie, const TriePattern *pattern);
+void trie_iterator_seek (TrieIterator *it, const TrieChar *after, size_t len);
+void trie_iterator_free (TrieIterator *it);
+Bool trie_iterator_next (TrieIterator *it, const TrieChar **o_key, size_t *o_len, TrieData *o_data);
+Bool trie_iterator_failed (const TrieIterator *it);
+Bool trie_keep_weights (Trie *trie, TrieWeightFunc weigh);
+void trie_reweigh_len (Trie *trie, const TrieChar *key, size_t len);
+Bool trie_top_k (const Trie *trie, const TrieChar *prefix, size_t len, size_t k, TrieKeyFunc func, void *user_data);
 TrieState * trie_root (const Trie *trie);
-static TrieState * trie_state_new (const Trie *trie, TrieIndex index, short suffix_idx, short is_suffix);
+static TrieState * trie_state_new (const Trie *trie, TrieIndex index, int suffix_idx, short is_suffix);
 TrieState * trie_state_clone (const TrieState *s);
 void trie_state_free (TrieState *s);
 void trie_state_rewind (TrieState *s);
 Bool trie_state_walk (TrieState *s, TrieChar c);
+Bool trie_state_walk_key (TrieState *s, const TrieChar *key, size_t len);
 Bool trie_state_is_walkable (const TrieState *s, TrieChar c);
+int trie_state_walkable_chars (const TrieState *s, TrieChar chars[], int chars_nelm);
 Bool trie_state_is_leaf (const TrieState *s);
 TrieData trie_state_get_data (const TrieState *s);
 
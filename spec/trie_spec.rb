@@ -8,6 +8,50 @@ describe Trie do
     @trie.add('frederico')
   end
   
+  describe :new do
+    it 'accepts a capacity hint' do
+      trie = Trie.new(:capacity => 1000, :avg_key_len => 6)
+      1000.times { |i| trie.add("key#{i}", i) }
+      trie.get('key999').should == 999
+      trie.children('key99').size.should == 11
+    end
+
+    it 'accepts an alphabet' do
+      trie = Trie.new(:alphabet => 'abcdefghijklmnopqrstuvwxyz0123456789')
+      trie.add('sku42', 42).should == true
+      trie.add('sku7', 7).should == true
+      trie.add('SKU1').should be_nil
+      trie.get('sku42').should == 42
+      trie.has_key?('SKU1').should be_nil
+      trie.children('sku').should == %w(sku42 sku7)
+    end
+  end
+
+  describe :build do
+    it 'builds a trie from sorted keys' do
+      trie = Trie.build(%w(rock rocket rocky zebra))
+      trie.has_key?('rocky').should be_true
+      trie.get('zebra').should == -1
+      trie.children('rock').sort.should == %w(rock rocket rocky)
+    end
+
+    it 'builds a trie from unsorted keys and values, keeping the last value' do
+      trie = Trie.build([['b', 2], ['ab', 1], ['a', 0], ['b', 3]])
+      trie.get('a').should == 0
+      trie.get('ab').should == 1
+      trie.get('b').should == 3
+      trie.children('').size.should == 3
+    end
+
+    it 'builds a trie that can be added to and deleted from' do
+      trie = Trie.build('key000'..'key999')
+      trie.add('key1000', 5)
+      trie.delete('key500').should == true
+      trie.get('key1000').should == 5
+      trie.children('key').size.should == 1000
+    end
+  end
+
   describe :has_key? do
     it 'returns true for words in the trie' do
       @trie.has_key?('rocket').should be_true
@@ -26,6 +70,32 @@ describe Trie do
     it 'returns nil if the word is not in the trie' do
       @trie.get('not_in_the_trie').should be_nil
     end
+
+    it 'looks up keys ending in the last byte value as the array grows' do
+      # walking byte 0xff from a state near the end of the pool reads the
+      # cells padding the array, which must stay free across every growth
+      trie = Trie.new
+      Array.new(3000) { |i| "#{i.to_s(36)}\xFF".b }.each_with_index do |key, i|
+        trie.add(key, i)
+        trie.get(key).should == i
+        trie.has_key?(key + "\xFF".b).should be_nil
+      end
+    end
+  end
+
+  describe :get_many do
+    it 'returns the value of each key, or nil' do
+      @trie.add('chicka', 123)
+      keys = %w(rocket chicka nope rock) + Array.new(20) { |i| "rock#{i}" }
+      @trie.get_many(keys).should == [-1, 123, nil, -1] + [nil] * 20
+    end
+  end
+
+  describe :has_keys? do
+    it 'tells for each key whether it is in the trie' do
+      @trie.has_keys?(%w(rocket roc frederico)).should == [true, nil, true]
+      @trie.has_keys?([]).should == []
+    end
   end
 
   describe :add do
@@ -48,6 +118,34 @@ describe Trie do
       @trie.add('doot', 'Heeey').should == true
       @trie.get('doot').should == 'Heeey'
     end
+
+    it 'adds binary keys with null bytes' do
+      @trie.add("ab\0c", 1).should == true
+      @trie.add("ab\1", 2).should == true
+      @trie.add("ab", 3).should == true
+      @trie.get("ab\0c").should == 1
+      @trie.get("ab\1").should == 2
+      @trie.has_key?("ab\0").should be_nil
+      @trie.children("ab").should == ["ab", "ab\0c", "ab\1"]
+    end
+  end
+
+  describe :add_all do
+    it 'adds keys and values given as pairs or a hash' do
+      @trie.add_all([['zebra', 1], ['apple', 2], 'mango']).should == true
+      @trie.add_all('pear' => 3, 'peach' => 4).should == true
+      @trie.get('zebra').should == 1
+      @trie.get('apple').should == 2
+      @trie.has_key?('mango').should == true
+      @trie.get('peach').should == 4
+    end
+
+    it 'keeps the last value given for a key' do
+      @trie.add_all([['rocket', 1], ['rock', 2], ['rocket', 3]])
+      @trie.get('rocket').should == 3
+      @trie.get('rock').should == 2
+      @trie.children('roc').sort.should == %w(rock rocket)
+    end
   end
 
   describe :delete do
@@ -55,6 +153,211 @@ describe Trie do
       @trie.delete('rocket').should == true
       @trie.has_key?('rocket').should be_nil
     end
+
+    it 'reuses the space of deleted words' do
+      trie = Trie.new
+      %w(alpha beta gamma).each { |w| trie.add(w, w.size) }
+      %w(alpha beta gamma).each { |w| trie.delete(w) }
+      %w(delta epsilon zeta eta).each { |w| trie.add(w, w.size) }
+      %w(delta epsilon zeta eta).each { |w| trie.get(w).should == w.size }
+      trie.children('').size.should == 4
+    end
+
+    it 'reuses the cells of nodes with many children across the array' do
+      # 24 nodes of 62 children each take well over one 64-cell word of the
+      # free map at a time, and fill several blocks of the array
+      labels = ('0'..'9').to_a + ('A'..'Z').to_a + ('a'..'z').to_a
+      keys = ('a'..'h').flat_map { |p| %w(x y z).flat_map { |q| labels.map { |c| "#{p}#{q}#{c}" } } }
+      trie = Trie.new
+      keys.each_with_index { |k, i| trie.add(k, i) }
+      keys.each_with_index { |k, i| trie.get(k).should == i }
+      keys.each_with_index { |k, i| trie.delete(k).should == true if i.odd? }
+      keys.each_with_index { |k, i| trie.get(k).should == (i.odd? ? nil : i) }
+      keys.each_with_index { |k, i| trie.add(k, -i) if i.odd? }
+      keys.each_with_index { |k, i| trie.get(k).should == (i.odd? ? -i : i) }
+      trie.children('').should == keys.sort
+    end
+  end
+
+  describe :increment do
+    it 'adds a missing key with the increment as its value' do
+      @trie.increment('counter').should == 1
+      @trie.increment('tally', 5).should == 5
+      @trie.get('tally').should == 5
+    end
+
+    it 'adds to the value of an existing key' do
+      @trie.add('counter', 10)
+      @trie.increment('counter', 3).should == 13
+      @trie.increment('counter', -20).should == -7
+      @trie.get('counter').should == -7
+    end
+
+    it 'raises an error when the value is not an integer' do
+      @trie.add('doot', 'Heeey')
+      lambda { @trie.increment('doot') }.should raise_error(TypeError)
+    end
+  end
+
+  describe :fetch_or_store do
+    it 'returns the value of an existing key' do
+      @trie.add('chicka', 123)
+      @trie.fetch_or_store('chicka', 0).should == 123
+      @trie.fetch_or_store('chicka') { 0 }.should == 123
+    end
+
+    it 'adds a missing key with the default or the block value' do
+      @trie.fetch_or_store('forsooth', 7).should == 7
+      @trie.fetch_or_store('boom') { |key| key.size }.should == 4
+      @trie.get('forsooth').should == 7
+      @trie.get('boom').should == 4
+    end
+  end
+
+  describe :longest_prefix do
+    it 'returns the longest key the string begins with, and its value' do
+      @trie.add('rock', 1)
+      @trie.add('rocket', 2)
+      @trie.longest_prefix('rocketry').should == ['rocket', 2]
+      @trie.longest_prefix('rocky').should == ['rock', 1]
+      @trie.longest_prefix('rocket').should == ['rocket', 2]
+    end
+
+    it 'returns nil if no key is a prefix of the string' do
+      @trie.longest_prefix('roc').should be_nil
+      @trie.longest_prefix('').should be_nil
+    end
+
+    it 'matches keys with null bytes' do
+      @trie.add("a\0b", 1)
+      @trie.add("a", 2)
+      @trie.longest_prefix("a\0bc").should == ["a\0b", 1]
+      @trie.longest_prefix("a\0c").should == ["a", 2]
+    end
+  end
+
+  describe :prefixes_of do
+    it 'returns every key the string begins with, with its value and end' do
+      @trie.add('rock', 1)
+      @trie.add('rocket', 2)
+      @trie.add('r', 3)
+      @trie.prefixes_of('rocketry').should == [['r', 3, 1], ['rock', 1, 4], ['rocket', 2, 6]]
+      @trie.prefixes_of('frock', 1).should == [['r', 3, 2], ['rock', 1, 5]]
+      @trie.prefixes_of('xyz').should == []
+    end
+
+    it 'yields each key to a block' do
+      @trie.add('rock', 1)
+      found = []
+      @trie.prefixes_of('rocket') { |key, value, stop| found << [key, stop] }
+      found.should == [['rock', 4], ['rocket', 6]]
+    end
+  end
+
+  describe :fuzzy do
+    before :each do
+      %w(rock rocks sock rack rocket).each_with_index { |w, i| @trie.add(w, i) }
+    end
+
+    it 'returns the keys within the distance, nearest first' do
+      @trie.fuzzy('rock', 1).should == [['rock', 0, 0], ['rack', 1, 3], ['rocks', 1, 1], ['sock', 1, 2]]
+      @trie.fuzzy('rockt', 1).map(&:first).should == %w(rock rocket rocks)
+      @trie.fuzzy('zzz', 2).should == []
+    end
+
+    it 'returns no more keys than the limit' do
+      @trie.fuzzy('rock', 2, :limit => 2).should == [['rock', 0, 0], ['rack', 1, 3]]
+    end
+  end
+
+  describe :match do
+    before :each do
+      %w(rack rock rocks sock bat cat SKU-12-a SKU-345-b).each { |w| @trie.add(w, w.size) }
+    end
+
+    it 'returns the keys matching wildcards and classes' do
+      @trie.match('r?ck*').should == %w(rack rock rocket rocks)
+      @trie.match('[bc]at').should == %w(bat cat)
+      @trie.match('[^b]at').should == %w(cat)
+      @trie.match('SKU-??-*').should == %w(SKU-12-a)
+      @trie.match('zz*').should == []
+    end
+
+    it 'yields each key with its value' do
+      found = []
+      @trie.match('?ock') { |key, value| found << [key, value] }
+      found.should == [['rock', 4], ['sock', 4]]
+    end
+
+    it 'does not let the block change the trie' do
+      lambda { @trie.match('*') { @trie.add('new') } }.should raise_error(RuntimeError)
+      @trie.add('new').should == true
+    end
+
+    it 'ends the walk when the block breaks' do
+      @trie.match('r*') { |key, value| break }
+      @trie.add('rust', 4).should == true
+      @trie.match('r*').should == %w(rack rock rocket rocks rust)
+    end
+  end
+
+  describe :each_key do
+    it 'yields the keys under a prefix in order' do
+      keys = []
+      @trie.each_key('r') { |key| keys << key }
+      keys.should == @trie.children('r').sort
+      @trie.each_key('roc', :limit => 1).to_a.should == ['rock']
+      @trie.each_key('zzz').to_a.should == []
+    end
+
+    it 'stops walking when the block breaks' do
+      keys = []
+      @trie.each_key { |key| keys << key; break if keys.size == 2 }
+      keys.size.should == 2
+      @trie.add('new').should == true
+      lambda { @trie.each_key { @trie.add('newer') } }.should raise_error(RuntimeError)
+    end
+
+    it 'returns a lazy enumerator without a block' do
+      @trie.each_key('r').should be_a(Enumerator::Lazy)
+      @trie.each_key('r').first(2).should == @trie.children('r').sort.first(2)
+    end
+  end
+
+  describe :each_pair do
+    it 'yields each key with its value' do
+      pairs = []
+      @trie.each_pair('roc') { |key, value| pairs << [key, value] }
+      pairs.should == @trie.children_with_values('roc').sort
+    end
+  end
+
+  describe :top_k do
+    before :each do
+      @ranked = Trie.new
+      { 'apple' => 50, 'apply' => 80, 'ape' => 20, 'apex' => 65, 'banana' => 90, 'app' => 't' }.each do |k, v|
+        @ranked.add(k, v)
+      end
+    end
+
+    it 'returns the keys under a prefix with the largest values first' do
+      @ranked.top_k('ap', 3).should == [['apply', 80], ['apex', 65], ['apple', 50]]
+      @ranked.top_k('', 2).should == [['banana', 90], ['apply', 80]]
+      @ranked.top_k('apples', 3).should == []
+      @ranked.top_k('app', 0).should == []
+    end
+
+    it 'keeps up with keys added, changed and deleted' do
+      @ranked.top_k('ap', 1).should == [['apply', 80]]
+      @ranked.add('apricot', 99)
+      @ranked.increment('ape', 70)
+      @ranked.top_k('ap', 2).should == [['apricot', 99], ['ape', 90]]
+      @ranked.delete('apricot')
+      @ranked.add('ape', 1)
+      @ranked.top_k('ap', 2).should == [['apply', 80], ['apex', 65]]
+      @ranked.compact!
+      @ranked.top_k('a', 5).should == [['apply', 80], ['apex', 65], ['apple', 50], ['ape', 1]]
+    end
   end
 
   describe :children do
@@ -69,6 +372,15 @@ describe Trie do
       @trie.children('ajsodij').should == []
     end
 
+    it 'pages through the keys after a given key' do
+      %w(rock rocker rocket rocks rocky).each { |w| @trie.add(w) }
+      @trie.children('roc', :limit => 2).should == %w(rock rocker)
+      @trie.children('roc', :after => 'rocker', :limit => 2).should == %w(rocket rocks)
+      @trie.children('roc', :after => 'rockf').should == %w(rocks rocky)
+      @trie.children('roc', :after => 'rocky').should == []
+      @trie.children('roc', :after => 'a', :limit => 1).should == %w(rock)
+    end
+
     it 'includes the prefix if the prefix is a word' do
       children = @trie.children('rock')
       children.size.should == 2
@@ -79,6 +391,13 @@ describe Trie do
     it 'returns blank array if prefix is nil' do
       @trie.children(nil).should == []
     end
+
+    it 'returns children branching on every byte value' do
+      (1..255).each { |b| @trie.add('w' + b.chr) }
+      children = @trie.children('w')
+      children.size.should == 255
+      children.should include('w' + 255.chr)
+    end
   end
 
   describe :children_with_values do
@@ -156,6 +475,175 @@ describe Trie do
         trie2.get('omgwtflolbbq').should == 123
       end
     end
+
+    it 'keeps the alphabet of the trie' do
+      trie = Trie.new(:alphabet => 'abcdefghijklmnopqrstuvwxyz')
+      trie.add('rocket', 1)
+      trie.save(filename_base)
+      trie2 = Trie.read(filename_base)
+      trie2.get('rocket').should == 1
+      trie2.add('Rocket').should be_nil
+      trie2.children('ro').should == ['rocket']
+    end
+
+    it 'keeps every suffix intact after heavy churn' do
+      500.times { |i| @trie.add("rock#{i}star", i) }
+      250.times { |i| @trie.delete("rock#{i * 2}star") }
+      @trie.add('rockets', 5)
+      @trie.save(filename_base)
+      trie2 = Trie.read(filename_base)
+      trie2.get('rock499star').should == 499
+      trie2.get('rockets').should == 5
+      trie2.has_key?('rock498star').should be_nil
+      trie2.children('rock4').size.should == 55
+    end
+
+    it 'keeps every key after nodes collide on their bases' do
+      # 'b' gaining many children after 'a' runs into the cells of the root,
+      # which must not move under it; dense short keys added out of order
+      # then run into the cells of siblings, which are moved instead
+      labels = ('0'..'9').to_a + ('A'..'Z').to_a + ('a'..'z').to_a
+      keys = labels.map { |c| "a#{c}" } + labels.map { |c| "b#{c}" }
+      keys += (1..5).flat_map { |n| %w(w x y z).repeated_permutation(n).map(&:join) }.shuffle(:random => Random.new(7))
+      trie = Trie.new
+      keys.each_with_index { |k, i| trie.add(k, i) }
+      keys.each_with_index { |k, i| trie.get(k).should == i }
+      trie.save(filename_base)
+      trie2 = Trie.read(filename_base)
+      trie2.children('').should == keys.sort
+      keys.each_with_index { |k, i| trie2.get(k).should == i }
+    end
+
+    it 'keeps suffixes of every length around the short suffix size' do
+      # suffixes of up to 3 bytes and their terminator fit in the tail block
+      # itself, longer ones go to the arena
+      keys = (0..5).map { |n| "s#{n}" + 'x' * n }
+      keys.each_with_index { |k, i| @trie.add(k, i) }
+      keys.each_with_index { |k, i| @trie.get(k).should == i }
+      keys.each_with_index { |k, i| @trie.delete(k).should == true if i.even? }
+      keys.each_with_index { |k, i| @trie.get(k).should == (i.even? ? nil : i) }
+      keys.each_with_index { |k, i| @trie.add(k, 10 + i) if i.even? }
+      keys.each_with_index { |k, i| @trie.get(k).should == (i.even? ? 10 + i : i) }
+      @trie.save(filename_base)
+      trie2 = Trie.read(filename_base)
+      trie2.children('s').should == keys
+      keys.each { |k| trie2.get(k).should == @trie.get(k) }
+      trie2.add('s3xy', 20)
+      trie2.get('s3xxx').should == @trie.get('s3xxx')
+      trie2.get('s3xy').should == 20
+    end
+
+    it 'keeps keys longer than 32K bytes' do
+      long = 'z' * 40_000
+      @trie.add(long, 1)
+      @trie.add(long + "\0", 2)
+      @trie.save(filename_base)
+      trie2 = Trie.read(filename_base)
+      trie2.get(long).should == 1
+      trie2.get(long + "\0").should == 2
+      trie2.children('z').size.should == 2
+    end
+
+    it 'keeps the values of keys sharing a common ending' do
+      %w(station nation ration tion on n).each_with_index { |w, i| @trie.add("x#{w}", i) }
+      @trie.add('ystation', 10)
+      @trie.save(filename_base)
+      trie2 = Trie.read(filename_base)
+      trie2.get('xnation').should == 1
+      trie2.get('xon').should == 4
+      trie2.get('ystation').should == 10
+      trie2.add('xtionary', 11)
+      trie2.get('xtion').should == 3
+      trie2.get('xtionary').should == 11
+    end
+
+    it 'reads the byte 0x01 of files from before keys were escaped' do
+      # "a\0" is stored as "a\x01\x01"; older files hold that byte as it is
+      @trie.add("a\0", 1)
+      @trie.add('ab', 2)
+      @trie.save(filename_base)
+      File.open("#{filename_base}.tail", 'r+b') { |f| f.write([0xDFFCDFFD].pack('N')) }
+      trie2 = Trie.read(filename_base)
+      trie2.children('a').should == ["a\x01\x01", 'ab']
+      trie2.get("a\x01\x01").should == 1
+      trie2.get("a\0").should be_nil
+      trie2.get('ab').should == 2
+    end
+  end
+
+  describe :compact! do
+    let(:filename_base) do
+      dir = File.expand_path(File.join(File.dirname(__FILE__), '..', 'tmp'))
+      FileUtils.mkdir_p(dir)
+      File.join(dir, 'trie')
+    end
+
+    it 'keeps every word and value after deletions' do
+      200.times { |i| @trie.add("word#{i}", i) }
+      100.times { |i| @trie.delete("word#{i * 2}") }
+      @trie.compact!.should == @trie
+      @trie.get('word199').should == 199
+      @trie.has_key?('word198').should be_nil
+      @trie.children('word1').size.should == 56
+      @trie.get('rocket').should == -1
+    end
+
+    it 'leaves a trie that can still be added to' do
+      @trie.delete('frederico')
+      @trie.compact!
+      @trie.add('freddy', 7)
+      @trie.get('freddy').should == 7
+      @trie.children('rock').should include('rocket')
+    end
+
+    it 'shrinks the array after deletions' do
+      2000.times { |i| @trie.add("word#{i}", i) }
+      1900.times { |i| @trie.delete("word#{i}") }
+      @trie.save(filename_base)
+      size = File.size(filename_base + '.da')
+      @trie.compact!
+      @trie.save(filename_base)
+      File.size(filename_base + '.da').should < size / 4
+      @trie.children('word').size.should == 100
+    end
+  end
+
+  describe :scanner do
+    before :each do
+      @trie = Trie.new
+      { 'he' => 1, 'she' => 2, 'his' => 3, 'hers' => 4 }.each { |k, v| @trie.add(k, v) }
+    end
+
+    it 'finds every occurrence of every key in one pass' do
+      @trie.scanner.scan('ushers').should == [[1, 3, 2], [2, 2, 1], [2, 4, 4]]
+      @trie.scanner.scan('nothing').should == []
+    end
+
+    it 'yields each occurrence to a block' do
+      found = []
+      @trie.scanner.scan('this') { |start, len, value| found << [start, len, value] }
+      found.should == [[1, 3, 3]]
+    end
+
+    it 'finds keys spanning the chunks of a stream' do
+      stream = @trie.scanner.stream
+      stream.feed('us').should == []
+      stream.feed('h').should == []
+      stream.feed('ers').should == [[1, 3, 2], [2, 2, 1], [2, 4, 4]]
+      stream.offset.should == 6
+    end
+
+    it 'finds keys ending in the last byte value' do
+      keys = Array.new(3000) { |i| "#{i.to_s(36)}\xFF".b }
+      trie = Trie.new
+      keys.each_with_index { |key, i| trie.add(key, i) }
+      text = keys.first(40).join(' ').b
+      expected = []
+      text.size.times do |start|
+        keys.each_with_index { |key, i| expected << [start, key.size, i] if text[start, key.size] == key }
+      end
+      trie.scanner.scan(text).sort.should == expected.sort
+    end
   end
 
   describe :read do